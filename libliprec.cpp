@@ -20,7 +20,16 @@
 #include "liprec.h"
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <map>
+#include <list>
+#include <stdint.h>
 #include "opencv2/opencv.hpp"
+#include "tesseract/resultiterator.h"
 #ifdef __SHOWIMAGES
    #include "opencv2/highgui/highgui.hpp"
 #endif
@@ -44,12 +53,716 @@ cv::String Filter(const std::string &to)
 }
 
 
+void Plate::render(const cv::Mat &img, cv::Mat &out) const
+{
+   img.copyTo(out);
+   rectangle(out, rect, cv::Scalar(0,0,255), 3);
+}
+
+void PlatesImage::render(const cv::Mat &img, cv::Mat &out) const
+{
+   img.copyTo(out);
+   for(unsigned int i=0;i<plates.size();i++)
+      rectangle(out, plates[i].rect, cv::Scalar(0,0,255), 3);
+}
+
+
 class LiprecException : public std::runtime_error
 {
    public:
       LiprecException(const char* except) : runtime_error(except) { }
 };
 
+
+// Scratch buffers of the detection pipeline, sized on the first frame and
+// reused after that, the contour points included. Every time one of them
+// has to grow the growth counters are incremented, so after warm-up they
+// should stay at zero.
+// NOTE: they count only these buffers. The scratch OpenCV allocates inside
+// its functions (the filter engines, the contour scanner...), the strings
+// and the plates still allocate on every frame and are not counted.
+struct Workspace
+{
+   cv::Mat kernel;
+   cv::Mat optimized, hsv, th, bh, s1, edge;
+   cv::Mat mask, patch, crop, ocrimg;
+   cv::Mat level[2];
+   std::vector< std::vector<cv::Point> > contours, scaled;
+   size_t ncontours;             // of the frame, contours is never shrunk
+   CvMemStorage *storage;        // cleared, not freed, between frames
+   std::vector< std::vector<cv::Point> > approx;   // one per filter chunk, not counted
+   std::vector<unsigned char> verdicts;            // one per contour
+   unsigned long growth, frame_growth;
+   unsigned long seen, rejected[LIPREC_REJECT_RULES];
+   StageStats *stats;            // NULL if the timing is disabled
+
+   Workspace() : ncontours(0), storage(NULL), growth(0), frame_growth(0), seen(0), stats(NULL)
+   {
+      std::fill(rejected, rejected+LIPREC_REJECT_RULES, 0UL);
+      kernel = getStructuringElement(cv::MORPH_ELLIPSE, cv::Size(3,3), cv::Point(1,1));
+   }
+
+   ~Workspace()
+   {
+      if(storage)
+         cvReleaseMemStorage(&storage);
+   }
+
+   void beginFrame()
+   {
+      frame_growth=0;
+   }
+
+   void grown()
+   {
+      growth++;
+      frame_growth++;
+   }
+
+   // Get a size x type image backed by store, that is reallocated only if
+   // too small. The returned header is not a submatrix, so filters don't
+   // look at the pixels around it, and it is valid up to the next call
+   // with the same store.
+   cv::Mat buffer(cv::Mat &store, cv::Size size, int type)
+   {
+      size_t bytes = (size_t)size.area()*CV_ELEM_SIZE(type);
+      if(store.total() < bytes) {
+         store.create(1, (int)bytes, CV_8UC1);
+         grown();
+      }
+      return cv::Mat(size, type, store.data);
+   }
+
+   template<typename T> void track(const std::vector<T> &v, size_t capacity)
+   {
+      if(v.capacity() != capacity)
+         grown();
+   }
+
+   // The external contours of edge, which is modified, in the first
+   // ncontours slots of contours. cv::findContours would resize contours
+   // to the count and so free and reallocate the points of every contour
+   // on every frame: here the points are found in storage, then copied
+   // into slots that are kept and only grow.
+   size_t findContours(cv::Mat &edge)
+   {
+      if(storage == NULL) {
+         storage = cvCreateMemStorage(0);
+         grown();
+      } else
+         cvClearMemStorage(storage);
+      CvMat image = edge;
+      CvSeq *first = NULL;
+      cvFindContours(&image, storage, &first, sizeof(CvContour), CV_RETR_EXTERNAL,
+                     CV_CHAIN_APPROX_NONE);
+      ncontours = 0;
+      for(CvSeq *seq = first; seq != NULL; seq = seq->h_next) {
+         if(ncontours == contours.size()) {
+            size_t capacity = contours.capacity();
+            contours.push_back(std::vector<cv::Point>());
+            track(contours, capacity);
+         }
+         std::vector<cv::Point> &points = contours[ncontours++];
+         size_t capacity = points.capacity();
+         points.resize(seq->total);
+         track(points, capacity);
+         if(seq->total > 0)
+            cvCvtSeqToArray(seq, &points[0]);
+      }
+      return ncontours;
+   }
+
+   // Next candidate slot of frame, slots are kept across frames
+   Candidate &nextCandidate(FrameCandidates *frame)
+   {
+      std::vector<Candidate> &candidates = frame->candidates;
+      if(frame->count == candidates.size()) {
+         size_t capacity = candidates.capacity();
+         candidates.push_back(Candidate());
+         track(candidates, capacity);
+      }
+      Candidate &c = candidates[frame->count++];
+      c.text.clear();
+      c.confidence = 0;
+      c.confidences.clear();
+      c.skip = false;
+      c.band = 0;
+      return c;
+   }
+};
+
+
+// Adds the time from its creation to timing[stage], in microseconds.
+// With timing NULL it does nothing, not even reading the clock.
+class StageTimer
+{
+   public:
+      StageTimer(double *timing, int stage)
+         : times(timing), idx(stage), start(timing ? cv::getTickCount() : 0) { }
+      // Time added to a single value, not to the LIPREC_STAGES array
+      explicit StageTimer(double *time)
+         : times(time), idx(0), start(time ? cv::getTickCount() : 0) { }
+
+      ~StageTimer()
+      {
+         stop();
+      }
+
+      void stop()
+      {
+         if(times)
+            times[idx] += (cv::getTickCount() - start)*1000000.0/cv::getTickFrequency();
+         times = NULL;
+      }
+
+   private:
+      double *times;
+      int idx;
+      int64 start;
+};
+
+
+StageStats::StageStats()
+{
+   reset();
+}
+
+void StageStats::reset()
+{
+   frames = 0;
+   for(int s=0;s<LIPREC_STAGES;s++) {
+      last[s] = total[s] = 0;
+      for(int b=0;b<LIPREC_STATS_BUCKETS;b++)
+         histogram[s][b] = 0;
+   }
+}
+
+void StageStats::add(const double *timing)
+{
+   frames++;
+   for(int s=0;s<LIPREC_STAGES;s++) {
+      last[s] = timing[s];
+      total[s] += timing[s];
+      int b = 0;
+      while(b < LIPREC_STATS_BUCKETS-1 && timing[s] >= (double)(1UL << b))
+         b++;
+      histogram[s][b]++;
+   }
+}
+
+double StageStats::mean(int stage) const
+{
+   return frames ? total[stage]/frames : 0;
+}
+
+double StageStats::percentile(int stage, double p) const
+{
+   unsigned long seen = 0;
+   for(int b=0;b<LIPREC_STATS_BUCKETS;b++) {
+      seen += histogram[stage][b];
+      if(seen > 0 && seen >= p*frames)
+         return b == 0 ? 1 : (double)(1UL << b);
+   }
+   return 0;
+}
+
+const char *StageStats::name(int stage)
+{
+   static const char *names[LIPREC_STAGES] = {
+      "optimize", "edge", "contours", "filter", "crop", "plate", "recognize", "text"
+   };
+   return stage >= 0 && stage < LIPREC_STAGES ? names[stage] : "";
+}
+
+
+// Perceptual hash of an OCR image: the image reduced to HASH_COLS x
+// HASH_ROWS, one bit per cell brighter than the mean. Plates are wide, so
+// are the cells.
+#define HASH_COLS   (32)
+#define HASH_ROWS   (LIPREC_CACHE_HASH_BITS/HASH_COLS)
+#define HASH_WORDS  (LIPREC_CACHE_HASH_BITS/64)
+
+struct PlateHash
+{
+   uint64_t bits[HASH_WORDS];
+   cv::Size size;
+
+   // small is a scratch buffer
+   void compute(const cv::Mat &ocrimg, cv::Mat &small)
+   {
+      size = ocrimg.size();
+      cv::resize(ocrimg, small, cv::Size(HASH_COLS, HASH_ROWS), 0, 0, cv::INTER_AREA);
+      double mean = cv::mean(small)[0];
+      std::fill(bits, bits+HASH_WORDS, (uint64_t)0);
+      for(int y=0;y<HASH_ROWS;y++) {
+         const uchar *row = small.ptr(y);
+         for(int x=0;x<HASH_COLS;x++)
+            if(row[x] > mean) {
+               int b = y*HASH_COLS + x;
+               bits[b/64] |= (uint64_t)1 << (b%64);
+            }
+      }
+   }
+
+   int distance(const PlateHash &other) const
+   {
+      int d = 0;
+      for(int w=0;w<HASH_WORDS;w++)
+         d += __builtin_popcountll(bits[w] ^ other.bits[w]);
+      return d;
+   }
+
+   // within an eighth of the width and of the height
+   bool sameSize(const PlateHash &other) const
+   {
+      return std::abs(size.width - other.size.width)*8 <= size.width &&
+             std::abs(size.height - other.size.height)*8 <= size.height;
+   }
+};
+
+
+// The last OCR results by the hash of the image read, the least recently
+// used one is dropped first. A lookup takes the closest entry within
+// max_distance bits. The engines of a pool share it, so it is locked.
+class OCRCache
+{
+   public:
+      OCRCache(size_t entries, int max_distance)
+         : hits(0), misses(0), capacity(entries), max_distance(max_distance) { }
+
+      bool lookup(const PlateHash &hash, Candidate &candidate)
+      {
+         std::lock_guard<std::mutex> guard(lock);
+         std::list<Entry>::iterator best = entries.end();
+         int best_distance = max_distance+1;
+         for(std::list<Entry>::iterator e = entries.begin(); e != entries.end(); ++e) {
+            int d = e->hash.distance(hash);
+            if(d < best_distance && e->hash.sameSize(hash)) {
+               best = e;
+               best_distance = d;
+            }
+         }
+         if(best == entries.end()) {
+            misses++;
+            return false;
+         }
+         entries.splice(entries.begin(), entries, best);
+         candidate.text = best->text;
+         candidate.confidence = best->confidence;
+         candidate.confidences = best->confidences;
+         hits++;
+         return true;
+      }
+
+      void store(const PlateHash &hash, const Candidate &candidate)
+      {
+         std::lock_guard<std::mutex> guard(lock);
+         if(entries.size() >= capacity) {
+            // reuse the oldest entry and its strings
+            entries.splice(entries.begin(), entries, --entries.end());
+         } else
+            entries.push_front(Entry());
+         Entry &e = entries.front();
+         e.hash = hash;
+         e.text = candidate.text;
+         e.confidence = candidate.confidence;
+         e.confidences = candidate.confidences;
+      }
+
+      std::atomic<unsigned long> hits, misses;
+
+   private:
+      struct Entry {
+         PlateHash hash;
+         cv::String text;
+         int confidence;
+         std::vector<int> confidences;
+      };
+      std::list<Entry> entries;   // most recently used first
+      size_t capacity;
+      int max_distance;
+      std::mutex lock;
+};
+
+
+// Tesseract instance set up for plates, or the shared glyph recognizer
+// if glyphs is not NULL. Tesseract is loaded by start(), on first use.
+class OCREngine
+{
+   public:
+      OCREngine(tesseract::PageSegMode pagetype, const GlyphRecognizer *glyphs)
+         : api(NULL), glyphs(glyphs), pagetype(pagetype), band(0)
+      {
+      }
+
+      // Load the Tesseract model if not done yet
+      void start()
+      {
+         if(glyphs || api)
+            return;
+         api = new tesseract::TessBaseAPI();
+         if(api->Init(NULL, NULL, tesseract::OEM_DEFAULT, NULL, 0, NULL, NULL, false)) {
+            delete api;
+            api = NULL;
+            throw LiprecException("Could not initialize tesseract OCR");
+         }
+         api->SetPageSegMode(pagetype);
+         api->SetVariable("tessedit_char_whitelist", "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ");
+      }
+
+      ~OCREngine()
+      {
+         if(api == NULL)
+            return;
+         api->Clear();
+         api->End();
+         delete api;
+      }
+
+      // timing is NULL or the LIPREC_STAGES times of the engine, cache
+      // is NULL or the results already seen
+      void recognize(Candidate &candidate, double *timing, OCRCache *cache,
+                     const PlateFormat &format)
+      {
+         if(candidate.skip)
+            return;
+         const cv::Mat &ocrimg = candidate.ocrimage;
+         StageTimer recognizing(timing, LIPREC_STAGE_RECOGNIZE);
+         PlateHash hash;
+         if(cache) {
+            hash.compute(ocrimg, small);
+            if(cache->lookup(hash, candidate))
+               return;
+         }
+         read(candidate, recognizing, timing, format);
+         if(cache)
+            cache->store(hash, candidate);
+      }
+
+      double timing[LIPREC_STAGES];   // of the current job
+
+   private:
+      tesseract::TessBaseAPI *api;
+      const GlyphRecognizer *glyphs;
+      tesseract::PageSegMode pagetype;
+      long band;                      // Candidate::band set in Tesseract, 0 none
+      cv::Mat small;                  // hash scratch
+      std::vector<SymbolChoices> choices;
+      std::string decoded;
+
+      void read(Candidate &candidate, StageTimer &recognizing, double *timing,
+                const PlateFormat &format)
+      {
+         const cv::Mat &ocrimg = candidate.ocrimage;
+         if(glyphs) {
+            candidate.text = glyphs->recognize(ocrimg, &candidate.confidences);
+            int sum = 0;
+            for(unsigned int i=0;i<candidate.confidences.size();i++)
+               sum += candidate.confidences[i];
+            candidate.confidence = candidate.confidences.empty() ? 0 :
+                                   sum/(int)candidate.confidences.size();
+            if(format.empty())
+               return;
+            // one choice per character, the format can still swap look-alikes
+            choices.resize(candidate.text.size());
+            for(size_t i=0;i<choices.size();i++) {
+               SymbolChoice c = { candidate.text[i], (float)candidate.confidences[i] };
+               choices[i].assign(1, c);
+            }
+            decodeChoices(candidate, format);
+            return;
+         }
+         if(candidate.band) {
+            // the band is converted once, then only the rectangle changes
+            cv::Size whole;
+            cv::Point offset;
+            ocrimg.locateROI(whole, offset);
+            if(candidate.band != band) {
+               api->SetImage((uchar*)ocrimg.datastart, whole.width, whole.height,
+                             ocrimg.channels(), ocrimg.step1());
+               band = candidate.band;
+            }
+            api->SetRectangle(offset.x, offset.y, ocrimg.cols, ocrimg.rows);
+         } else {
+            api->SetImage((uchar*)ocrimg.data, ocrimg.size().width, ocrimg.size().height,
+                          ocrimg.channels(), ocrimg.step1());
+            band = 0;
+         }
+         api->Recognize(0);
+         recognizing.stop();
+         // XXX Gestire il caso in cui c'e' pagetype a single char
+         StageTimer texting(timing, LIPREC_STAGE_TEXT);
+         if(!format.empty()) {
+            symbolChoices();
+            decodeChoices(candidate, format);
+            return;
+         }
+         char* detected_text = api->GetUTF8Text();
+         candidate.confidence = api->MeanTextConf();
+         texting.stop();
+         candidate.text = detected_text;
+         delete [] detected_text;
+      }
+
+      // Every alternative Tesseract considered for every symbol read
+      void symbolChoices()
+      {
+         choices.clear();
+         tesseract::ResultIterator *it = api->GetIterator();
+         if(it == NULL)
+            return;
+         do {
+            if(it->Empty(tesseract::RIL_SYMBOL))
+               continue;
+            choices.push_back(SymbolChoices());
+            tesseract::ChoiceIterator choice(*it);
+            do {
+               const char *text = choice.GetUTF8Text();
+               if(text && text[0] && !text[1]) {
+                  SymbolChoice c = { text[0], choice.Confidence() };
+                  choices.back().push_back(c);
+               }
+            } while(choice.Next());
+         } while(it->Next(tesseract::RIL_SYMBOL));
+         delete it;
+      }
+
+      // The candidate text becomes the best valid string of choices, or
+      // nothing if no format fits
+      void decodeChoices(Candidate &candidate, const PlateFormat &format)
+      {
+         int confidence;
+         if(format.decode(choices, decoded, confidence)) {
+            candidate.text = decoded;
+            candidate.confidence = confidence;
+         } else {
+            candidate.text.clear();
+            candidate.confidence = 0;
+         }
+         // per character confidences do not survive the decoding
+         candidate.confidences.clear();
+      }
+};
+
+
+// Pool of OCR engines. recognize() spreads the candidates of a frame over
+// them: the calling thread uses the first engine and every other engine
+// has its own worker thread. Results are written in the candidates, so
+// their order never depends on the scheduling.
+class OCRPool
+{
+   public:
+      OCRPool(int workers, tesseract::PageSegMode pagetype, const PlateFormat &format,
+              const GlyphRecognizer *glyphs=NULL)
+         : cache(NULL), format(&format), job(NULL), job_count(0), busy(0), generation(0),
+           stop(false),
+           timed(false)
+      {
+         try {
+            for(int i=0;i<std::max(workers, 1);i++)
+               engines.push_back(new OCREngine(pagetype, glyphs));
+         } catch(...) {
+            for(unsigned int i=0;i<engines.size();i++)
+               delete engines[i];
+            throw;
+         }
+         for(unsigned int i=1;i<engines.size();i++)
+            threads.push_back(std::thread(&OCRPool::worker, this, i));
+      }
+
+      ~OCRPool()
+      {
+         {
+            std::lock_guard<std::mutex> guard(lock);
+            stop = true;
+         }
+         wake.notify_all();
+         for(unsigned int i=0;i<threads.size();i++)
+            threads[i].join();
+         for(unsigned int i=0;i<engines.size();i++)
+            delete engines[i];
+         delete cache;
+      }
+
+      // Not while recognize() is running
+      void setCache(int entries, int max_distance)
+      {
+         delete cache;
+         cache = entries > 0 ? new OCRCache(entries, max_distance) : NULL;
+      }
+
+      OCRCache *cache;   // NULL if disabled
+      const PlateFormat *format;   // of the LiPRec, that outlives the pool
+
+      int size() const
+      {
+         return engines.size();
+      }
+
+      // With timing not NULL the time of the OCR stages is added to it
+      void recognize(std::vector<Candidate> &candidates, size_t count, double *timing=NULL)
+      {
+         if(count == 0)
+            return;
+         // here, so a failure is thrown to the caller and not in a worker
+         for(unsigned int i=0;i<engines.size();i++)
+            engines[i]->start();
+         timed = timing != NULL;
+         for(unsigned int i=0;timed && i<engines.size();i++)
+            std::fill(engines[i]->timing, engines[i]->timing+LIPREC_STAGES, 0.0);
+         if(threads.empty() || count == 1) {
+            for(size_t i=0;i<count;i++)
+               engines[0]->recognize(candidates[i], timed ? engines[0]->timing : NULL, cache,
+                                     *format);
+         } else {
+            {
+               std::lock_guard<std::mutex> guard(lock);
+               job = &candidates[0];
+               job_count = count;
+               next = 0;
+               busy = threads.size();
+               generation++;
+            }
+            wake.notify_all();
+            work(engines[0]);
+            std::unique_lock<std::mutex> guard(lock);
+            while(busy > 0)
+               done.wait(guard);
+         }
+         for(unsigned int i=0;timed && i<engines.size();i++)
+            for(int s=0;s<LIPREC_STAGES;s++)
+               timing[s] += engines[i]->timing[s];
+      }
+
+   private:
+      std::vector<OCREngine*> engines;
+      std::vector<std::thread> threads;
+      std::mutex lock;
+      std::condition_variable wake, done;
+      Candidate *job;
+      size_t job_count;
+      std::atomic<size_t> next;
+      size_t busy;
+      unsigned long generation;
+      bool stop, timed;
+
+      void work(OCREngine *engine)
+      {
+         for(size_t i=next++; i<job_count; i=next++)
+            engine->recognize(job[i], timed ? engine->timing : NULL, cache, *format);
+      }
+
+      void worker(int idx)
+      {
+         unsigned long seen = 0;
+         for(;;) {
+            {
+               std::unique_lock<std::mutex> guard(lock);
+               while(!stop && generation == seen)
+                  wake.wait(guard);
+               if(stop)
+                  return;
+               seen = generation;
+            }
+            work(engines[idx]);
+            std::lock_guard<std::mutex> guard(lock);
+            if(--busy == 0)
+               done.notify_one();
+         }
+      }
+};
+
+DetectContext::DetectContext(const LiPRec &detector, int ocr_workers)
+{
+   ocr = new OCRPool(ocr_workers, detector.ocr_ptype, detector.format,
+                     detector.recognizer == LIPREC_OCR_GLYPHS ? detector.glyphs : NULL);
+   ocr->setCache(detector.cache_entries, detector.cache_distance);
+   ws = new Workspace();
+}
+
+DetectContext::~DetectContext()
+{
+   delete ocr;
+   delete ws->stats;
+   delete ws;
+}
+
+unsigned long DetectContext::frameBufferGrowth() const
+{
+   return ws->frame_growth;
+}
+
+unsigned long DetectContext::totalBufferGrowth() const
+{
+   return ws->growth;
+}
+
+void DetectContext::setTiming(bool enable)
+{
+   if(enable && ws->stats == NULL)
+      ws->stats = new StageStats();
+   if(!enable) {
+      delete ws->stats;
+      ws->stats = NULL;
+   }
+}
+
+const StageStats *DetectContext::stageStats() const
+{
+   return ws->stats;
+}
+
+unsigned long DetectContext::contoursSeen() const
+{
+   return ws->seen;
+}
+
+unsigned long DetectContext::contoursRejected(int rule) const
+{
+   return rule >= 0 && rule < LIPREC_REJECT_RULES ? ws->rejected[rule] : 0;
+}
+
+void DetectContext::setOCRCache(int entries, int max_distance)
+{
+   ocr->setCache(entries, max_distance);
+}
+
+unsigned long DetectContext::ocrCacheHits() const
+{
+   return ocr->cache ? ocr->cache->hits.load() : 0;
+}
+
+unsigned long DetectContext::ocrCacheMisses() const
+{
+   return ocr->cache ? ocr->cache->misses.load() : 0;
+}
+
+const char *DetectContext::rejectName(int rule)
+{
+   static const char *names[LIPREC_REJECT_RULES] = {
+      "length", "box", "area", "aspect", "fill", "polygon"
+   };
+   return rule >= 0 && rule < LIPREC_REJECT_RULES ? names[rule] : "";
+}
+
+
+PlateProfile PlateProfile::country(int country)
+{
+   switch(country)
+   {
+      case LIPREC_PLATE_EU:
+         return PlateProfile(3.0, 6.5, 0.7);   // 4.7
+      case LIPREC_PLATE_US:
+         return PlateProfile(1.4, 2.8, 0.7);   // 2.0
+      case LIPREC_PLATE_AU:
+         return PlateProfile(2.0, 3.8, 0.7);   // 2.8
+      case LIPREC_PLATE_ANY:
+      default:
+         return PlateProfile();
+   }
+}
+
+
 LiPRec::LiPRec(int optimization,
                int contour,
                int platecont,
@@ -63,7 +776,14 @@ LiPRec::LiPRec(int optimization,
    pcont=platecont;
    ocr_ptype=pagetype;
    min_confidence=min_ocr_confidence;
-   startOCR(pagetype);
+   recognizer=LIPREC_OCR_TESSERACT;
+   glyphs=NULL;
+   cache_entries=0;
+   cache_distance=LIPREC_CACHE_DISTANCE;
+   ocr_input=LIPREC_OCR_INPUT_CROPS;
+   context = new DetectContext(*this);
+   retention=LIPREC_RETAIN_TEXT;
+   search_level=LIPREC_SEARCH_FULL;
    thr_min=128;
    thr_max=255;
    athr_size=21;
@@ -88,56 +808,126 @@ LiPRec::LiPRec(int optimization,
 
 LiPRec::~LiPRec()
 {
-   if(OCR!=NULL)
-   {
-      OCR->Clear();
-      OCR->End();
-      delete OCR;
-   }
+   delete context;
+   for(unsigned int i=0;i<batch.size();i++)
+      delete batch[i];
+   delete glyphs;
 }
 
-void LiPRec::startOCR(tesseract::PageSegMode pagetype)
+void LiPRec::startOCR(tesseract::PageSegMode pagetype, int workers)
 {
    #ifdef __DEBUG
    std::cout << "LiPRec startOCR\n";
    #endif
 
-   OCR = new tesseract::TessBaseAPI();
-   if(OCR->Init(NULL, NULL, tesseract::OEM_DEFAULT, NULL, 0, NULL, NULL, false)) {
-      delete OCR;
-      throw LiprecException("Could not initialize tesseract OCR");
-   }
-   OCR->SetPageSegMode(pagetype);
-   OCR->SetVariable("tessedit_char_whitelist", "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ");
+   OCRPool *pool = new OCRPool(workers, pagetype, format,
+                               recognizer == LIPREC_OCR_GLYPHS ? glyphs : NULL);
+   pool->setCache(cache_entries, cache_distance);
+   delete context->ocr;
+   context->ocr = pool;
 }
 
+void LiPRec::setOCRWorkers(int workers)
+{
+   #ifdef __DEBUG
+   std::cout << "LiPRec setOCRWorkers\n";
+   #endif
+
+   if(workers != context->ocr->size())
+      startOCR(ocr_ptype, workers);
+}
+
+
+void LiPRec::setRecognizer(int engine)
+{
+   #ifdef __DEBUG
+   std::cout << "LiPRec setRecognizer\n";
+   #endif
+
+   if(engine == recognizer)
+      return;
+   if(engine == LIPREC_OCR_GLYPHS)
+      glyphRecognizer();
+   recognizer = engine;
+   startOCR(ocr_ptype, context->ocr->size());
+   // the batch contexts have the old engines
+   for(unsigned int i=0;i<batch.size();i++)
+      delete batch[i];
+   batch.clear();
+}
+
+void LiPRec::setOCRInput(int input)
+{
+   #ifdef __DEBUG
+   std::cout << "LiPRec setOCRInput\n";
+   #endif
+
+   ocr_input = input;
+}
+
+void LiPRec::setPlateFormat(const std::string &patterns)
+{
+   #ifdef __DEBUG
+   std::cout << "LiPRec setPlateFormat\n";
+   #endif
 
-void LiPRec::maximizeContrast(cv::Mat &img)
+   // the pools of the contexts refer to it, so it is replaced in place
+   format = PlateFormat(patterns);
+}
+
+GlyphRecognizer *LiPRec::glyphRecognizer()
+{
+   if(glyphs == NULL)
+      glyphs = new GlyphRecognizer();
+   return glyphs;
+}
+
+
+void LiPRec::setSearchLevel(int level)
+{
+   #ifdef __DEBUG
+   std::cout << "LiPRec setSearchLevel\n";
+   #endif
+
+   search_level = level < 0 ? LIPREC_SEARCH_AUTO : level;
+}
+
+
+void LiPRec::maximizeContrast(cv::Mat &img, Workspace *w) const
 {
    #ifdef __DEBUG
    std::cout << "LiPRec maximizeContrast\n";
    #endif
 
-   cv::Mat el=getStructuringElement(cv::MORPH_ELLIPSE, cv::Size(3,3), cv::Point(1,1));
-   cv::Mat bh(img.rows, img.cols, CV_8UC1);
-   cv::Mat th(img.rows, img.cols, CV_8UC1);
-   cv::Mat s1(img.rows, img.cols, CV_8UC1);
-   cv::morphologyEx(img, th, cv::MORPH_TOPHAT, el, cv::Point(1,1), 1);
-   cv::morphologyEx(img, bh, cv::MORPH_BLACKHAT, el, cv::Point(1,1), 1);
+   cv::Mat bh = w->buffer(w->bh, img.size(), CV_8UC1);
+   cv::Mat th = w->buffer(w->th, img.size(), CV_8UC1);
+   cv::Mat s1 = w->buffer(w->s1, img.size(), CV_8UC1);
+   cv::morphologyEx(img, th, cv::MORPH_TOPHAT, w->kernel, cv::Point(1,1), 1);
+   cv::morphologyEx(img, bh, cv::MORPH_BLACKHAT, w->kernel, cv::Point(1,1), 1);
    cv::add(img, th, s1);
    cv::subtract(s1,bh, img);
 
 }
 
-void LiPRec::extractV(const cv::Mat &inimg, cv::Mat &outimg)
+void LiPRec::maximizeContrast(cv::Mat &img, DetectContext &ctx) const
+{
+   maximizeContrast(img, ctx.ws);
+}
+
+void LiPRec::extractV(const cv::Mat &inimg, cv::Mat &outimg, Workspace *w) const
 {
    #ifdef __DEBUG
    std::cout << "LiPRec extractV\n";
    #endif
 
-   cv::Mat tvframe(inimg.rows, inimg.cols, CV_8UC3);
+   // hue and saturation would be thrown away
+   if(extractValue(inimg, outimg))
+      return;
+
+   cv::Mat tvframe = w->buffer(w->hsv, inimg.size(), CV_8UC3);
    cvtColor(inimg, tvframe, CV_RGB2HSV);
    int from_to[] = { 2,0 };
+   outimg.create(inimg.size(), CV_8UC1);
    mixChannels( &tvframe, 1, &outimg,1, from_to, 1);
 }
 
@@ -147,6 +937,20 @@ void LiPRec::optimizeImage(const cv::Mat &inimg, cv::Mat &outimg)
    std::cout << "LiPRec optimizeImage\n";
    #endif
 
+   _optimizeImage(inimg, outimg, context->ws);
+}
+
+void LiPRec::optimizeImage(const cv::Mat &inimg, cv::Mat &outimg, DetectContext &ctx) const
+{
+   #ifdef __DEBUG
+   std::cout << "LiPRec optimizeImage context\n";
+   #endif
+
+   _optimizeImage(inimg, outimg, ctx.ws);
+}
+
+void LiPRec::_optimizeImage(const cv::Mat &inimg, cv::Mat &outimg, Workspace *w) const
+{
    switch(opt)
    {
       case LIPREC_OPTIMIZATION_GREY_BASIC:
@@ -154,19 +958,24 @@ void LiPRec::optimizeImage(const cv::Mat &inimg, cv::Mat &outimg)
         break;
 
       case LIPREC_OPTIMIZATION_HSV_BASIC:
-        extractV(inimg, outimg);
+        extractV(inimg, outimg, w);
         break;
 
       case LIPREC_OPTIMIZATION_GREY_DEEP:
+        // all the steps below in a single pass
+        if(fusedDeepOptimize(inimg, outimg))
+           break;
         cvtColor(inimg, outimg, CV_RGB2GRAY);
-        maximizeContrast(outimg);
+        maximizeContrast(outimg, w);
         // Smooth image to remove rumor...
         cv::GaussianBlur(outimg, outimg, cv::Size(5,5), 5, 5, cv::BORDER_DEFAULT);
         break;
 
       case LIPREC_OPTIMIZATION_HSV_DEEP:
-        extractV(inimg, outimg);
-        maximizeContrast(outimg);
+        if(fusedDeepOptimize(inimg, outimg, true))
+           break;
+        extractV(inimg, outimg, w);
+        maximizeContrast(outimg, w);
         // Smooth image to remove rumor...
         cv::GaussianBlur(outimg, outimg, cv::Size(5,5), 5, 5, cv::BORDER_DEFAULT);
         break;
@@ -182,6 +991,90 @@ void LiPRec::setPerimeterConstant(int val)
    perimeter_constant = val/1000.0;
 }
 
+void LiPRec::setPlateProfile(int country)
+{
+   #ifdef __DEBUG
+   std::cout << "LiPRec setPlateProfile\n";
+   #endif
+
+   profile = PlateProfile::country(country);
+}
+
+void LiPRec::setPlateProfile(const PlateProfile &shape)
+{
+   #ifdef __DEBUG
+   std::cout << "LiPRec setPlateProfile shape\n";
+   #endif
+
+   profile = shape;
+}
+
+unsigned long LiPRec::frameBufferGrowth() const
+{
+   return context->frameBufferGrowth();
+}
+
+unsigned long LiPRec::totalBufferGrowth() const
+{
+   return context->totalBufferGrowth();
+}
+
+void LiPRec::setTiming(bool enable)
+{
+   #ifdef __DEBUG
+   std::cout << "LiPRec setTiming\n";
+   #endif
+
+   context->setTiming(enable);
+}
+
+const StageStats *LiPRec::stageStats() const
+{
+   return context->stageStats();
+}
+
+void LiPRec::setOCRCache(int entries, int max_distance)
+{
+   #ifdef __DEBUG
+   std::cout << "LiPRec setOCRCache\n";
+   #endif
+
+   cache_entries = std::max(entries, 0);
+   cache_distance = max_distance;
+   context->setOCRCache(cache_entries, cache_distance);
+   for(unsigned int i=0;i<batch.size();i++)
+      batch[i]->setOCRCache(cache_entries, cache_distance);
+}
+
+unsigned long LiPRec::ocrCacheHits() const
+{
+   return context->ocrCacheHits();
+}
+
+unsigned long LiPRec::ocrCacheMisses() const
+{
+   return context->ocrCacheMisses();
+}
+
+unsigned long LiPRec::contoursSeen() const
+{
+   return context->contoursSeen();
+}
+
+unsigned long LiPRec::contoursRejected(int rule) const
+{
+   return context->contoursRejected(rule);
+}
+
+void LiPRec::setRetention(int level)
+{
+   #ifdef __DEBUG
+   std::cout << "LiPRec setRetention\n";
+   #endif
+
+   retention=level;
+}
+
 void LiPRec::setThreshold(int min, int max)
 {
    #ifdef __DEBUG
@@ -221,35 +1114,279 @@ void LiPRec::setPlateAutothreshold(int size)
 }
 
 
-void LiPRec::detectPlates(cv::Mat &img, PlatesImage* plates,
+void LiPRec::detectPlates(const cv::Mat &img, PlatesImage* plates,
                          int min_area, int max_area)
 {
+   detectPlates(img, plates, *context, min_area, max_area);
+}
+
+void LiPRec::detectPlates(const cv::Mat &img, const cv::Mat &optimizedimage, PlatesImage* plates,
+                                                   int min_area, int max_area)
+{
+   detectPlates(img, optimizedimage, plates, *context, min_area, max_area);
+}
+
+void LiPRec::detectPlates(const cv::Mat &img, PlatesImage* plates, DetectContext &ctx,
+                          int min_area, int max_area) const
+{
 
    #ifdef __DEBUG
    std::cout << "LiPRec detectPlates no optimized\n";
    #endif
 
-   cv::Mat optimized(img.rows, img.cols, CV_8UC1);
-   optimizeImage(img, optimized);
-   _detectPlates(img, optimized, plates, min_area, max_area);
+   _findCandidates(img, &ctx.candidates, min_area, max_area, ctx.ws);
+   _recognizeCandidates(&ctx.candidates, plates, ctx.ocr, ctx.ws->stats);
 }
 
-void LiPRec::detectPlates(cv::Mat &img, cv::Mat &optimizedimage, PlatesImage* plates, 
-                                                   int min_area, int max_area)
+void LiPRec::detectPlates(const cv::Mat &img, const cv::Mat &optimizedimage, PlatesImage* plates,
+                          DetectContext &ctx, int min_area, int max_area) const
 {
    #ifdef __DEBUG
    std::cout << "LiPRec detectPlates optimized\n";
    #endif
 
-   _detectPlates(img, optimizedimage, plates, min_area, max_area);
+   ctx.ws->beginFrame();
+   _findCandidates(img, optimizedimage, &ctx.candidates, min_area, max_area, ctx.ws);
+   _recognizeCandidates(&ctx.candidates, plates, ctx.ocr, ctx.ws->stats);
 }
 
+void LiPRec::detectPlatesBatch(const std::vector<cv::Mat> &images,
+                               std::vector<PlatesImage> &results,
+                               int min_area, int max_area, int threads)
+{
+   #ifdef __DEBUG
+   std::cout << "LiPRec detectPlatesBatch\n";
+   #endif
+
+   results.clear();
+   results.resize(images.size());
+   if(threads <= 0)
+      threads = cv::getNumberOfCPUs();
+   threads = (int)std::min<size_t>(std::max(threads, 1), std::max<size_t>(images.size(), 1));
+   // OCR engines are slow to start, keep them for the next batches
+   while((int)batch.size() < threads)
+      batch.push_back(new DetectContext(*this));
+
+   std::atomic<size_t> next(0);
+   std::exception_ptr error;
+   std::mutex error_lock;
+   auto work = [&](DetectContext *ctx) {
+      try {
+         for(size_t i=next++; i<images.size(); i=next++) {
+            _findCandidates(images[i], &ctx->candidates, min_area, max_area, ctx->ws);
+            ctx->candidates.frame = i;
+            _recognizeCandidates(&ctx->candidates, &results[i], ctx->ocr, ctx->ws->stats);
+         }
+      } catch(...) {
+         std::lock_guard<std::mutex> guard(error_lock);
+         if(!error)
+            error = std::current_exception();
+         next = images.size();
+      }
+   };
+
+   std::vector<std::thread> pool;
+   for(int t=1;t<threads;t++)
+      pool.push_back(std::thread(work, batch[t]));
+   work(batch[0]);
+   for(unsigned int t=0;t<pool.size();t++)
+      pool[t].join();
+   if(error)
+      std::rethrow_exception(error);
+}
 
-void LiPRec::_detectPlates(cv::Mat &img, cv::Mat &optimizedimage, PlatesImage* plates,
-                         int min_area, int max_area)
+void LiPRec::findCandidates(const cv::Mat &img, FrameCandidates *candidates,
+                            int min_area, int max_area)
+{
+   #ifdef __DEBUG
+   std::cout << "LiPRec findCandidates\n";
+   #endif
+
+   _findCandidates(img, candidates, min_area, max_area, context->ws);
+}
+
+void LiPRec::findCandidates(const cv::Mat &img, FrameCandidates *candidates,
+                            DetectContext &ctx, int min_area, int max_area) const
+{
+   #ifdef __DEBUG
+   std::cout << "LiPRec findCandidates context\n";
+   #endif
+
+   _findCandidates(img, candidates, min_area, max_area, ctx.ws);
+}
+
+void LiPRec::findCandidates(const cv::Mat &img, const cv::Mat &optimizedimage,
+                            FrameCandidates *candidates, DetectContext &ctx,
+                            int min_area, int max_area) const
+{
+   #ifdef __DEBUG
+   std::cout << "LiPRec findCandidates optimized\n";
+   #endif
+
+   ctx.ws->beginFrame();
+   _findCandidates(img, optimizedimage, candidates, min_area, max_area, ctx.ws);
+}
+
+void LiPRec::recognizeCandidates(FrameCandidates *candidates, PlatesImage* plates)
+{
+   #ifdef __DEBUG
+   std::cout << "LiPRec recognizeCandidates\n";
+   #endif
+
+   _recognizeCandidates(candidates, plates, context->ocr, context->ws->stats);
+}
+
+void LiPRec::recognizeCandidates(FrameCandidates *candidates, PlatesImage* plates,
+                                 DetectContext &ctx) const
+{
+   #ifdef __DEBUG
+   std::cout << "LiPRec recognizeCandidates context\n";
+   #endif
+
+   _recognizeCandidates(candidates, plates, ctx.ocr, ctx.ws->stats);
+}
+
+void LiPRec::_findCandidates(const cv::Mat &img, FrameCandidates *candidates,
+                             int min_area, int max_area, Workspace *w) const
+{
+   w->beginFrame();
+   // the inner _findCandidates resets the frame timing, so keep it aside
+   double optimizing = 0;
+   StageTimer timer(w->stats ? &optimizing : NULL);
+   cv::Mat optimized = w->buffer(w->optimized, img.size(), CV_8UC1);
+   _optimizeImage(img, optimized, w);
+   timer.stop();
+   _findCandidates(img, optimized, candidates, min_area, max_area, w);
+   candidates->timing[LIPREC_STAGE_OPTIMIZE] = optimizing;
+}
+
+
+// Crop the candidate in box, mask, patch, crop and ocrimg have to be
+// already allocated with the box size.
+static void cropCandidate(const cv::Mat &optimizedimage,
+                          const std::vector< std::vector<cv::Point> > &contours,
+                          int idx, const cv::Rect &box, cv::Mat &mask,
+                          cv::Mat &patch, cv::Mat &crop, cv::Mat &ocrimg)
+{
+   cv::Point offset = -box.tl();
+
+   // Prepare a mask image
+   mask.setTo(cv::Scalar(0));
+   // draw the contours filled on the mask
+   cv::drawContours(mask, contours, idx, cv::Scalar(255,255,255), CV_FILLED, 8,
+                    cv::noArray(), INT_MAX, offset);
+   // copy the plate area of the optimized image and draw the contours
+   // on it to remove external lines. Being a local copy, the caller image
+   // is never touched and nothing has to be restored later
+   optimizedimage(box).copyTo(patch);
+   cv::drawContours(patch, contours, idx, cv::Scalar(255,255,255), 2, 2,
+                    cv::noArray(), INT_MAX, offset);
+   // copy the masked rectangle
+   crop.setTo(cv::Scalar(0));
+   patch.copyTo(crop, mask);
+
+   #ifdef __SHOWIMAGES
+     imshow("optimized", patch);
+     imshow("crop", crop);
+     imshow("mask", mask);
+   #endif
+
+   // prepare an image for the OCR with size equal to the rectangle
+   ocrimg.setTo(cv::Scalar(255));
+   crop.copyTo(ocrimg, crop);
+}
+
+cv::Rect cropCandidate(const cv::Mat &optimizedimage,
+                       const std::vector< std::vector<cv::Point> > &contours,
+                       int idx, cv::Mat &ocrimg)
+{
+   // get rectangle of the possible plate, all the work is done in it
+   cv::Rect box = cv::boundingRect(cv::Mat(contours[idx]));
+   cv::Mat mask(box.size(), CV_8UC1);
+   cv::Mat patch(box.size(), CV_8UC1);
+   cv::Mat crop(box.size(), CV_8UC1);
+   ocrimg.create(box.size(), CV_8UC1);
+   cropCandidate(optimizedimage, contours, idx, box, mask, patch, crop, ocrimg);
+   return box;
+}
+
+
+// Contours a filter chunk gets at least, fewer are not worth a thread
+#define FILTER_CHUNK   (128)
+#define FILTER_PASSED  (LIPREC_REJECT_RULES)
+
+// Judges the contours of a chunk: verdicts[i] is the LIPREC_REJECT_* rule
+// that threw contour i away, or FILTER_PASSED. Chunks only write their
+// own verdicts and their own approx scratch vector.
+class ContourFilter : public cv::ParallelLoopBody
+{
+   public:
+      ContourFilter(const std::vector< std::vector<cv::Point> > &contours, size_t count,
+                    std::vector<unsigned char> &verdicts,
+                    std::vector< std::vector<cv::Point> > &approx, int chunks,
+                    double min_area, double max_area, const PlateProfile &profile,
+                    float perimeter_constant)
+         : contours(contours), count(count), verdicts(verdicts), approx(approx), chunks(chunks),
+           min_area(min_area), max_area(max_area), min_perimeter(2*std::sqrt(M_PI*min_area)),
+           profile(profile), perimeter_constant(perimeter_constant) { }
+
+      void operator()(const cv::Range &range) const
+      {
+         size_t n = count;
+         for(int c=range.start;c<range.end;c++)
+            for(size_t i=c*n/chunks;i<(c+1)*n/chunks;i++)
+               verdicts[i] = judge(contours[i], approx[c]);
+      }
+
+   private:
+      // cheapest first: most contours are small noise, thrown away
+      // before anything walks their points
+      unsigned char judge(const std::vector<cv::Point> &contour,
+                          std::vector<cv::Point> &results) const
+      {
+         // a closed contour of n points is at most n*sqrt(2) long, and
+         // the shortest line around an area A is a circle, 2*sqrt(pi*A)
+         if(contour.size()*M_SQRT2 < min_perimeter)
+            return LIPREC_REJECT_LENGTH;
+         if(cv::boundingRect(contour).area() < min_area)
+            return LIPREC_REJECT_BOX;
+         double area = std::fabs(cv::contourArea(contour));
+         if(area < min_area || area > max_area)
+            return LIPREC_REJECT_AREA;
+         // cheap shape checks before the polygon approximation, that walks
+         // the whole CV_CHAIN_APPROX_NONE contour
+         cv::Size2f rotated = cv::minAreaRect(contour).size;
+         double longside = std::max(rotated.width, rotated.height);
+         double shortside = std::min(rotated.width, rotated.height);
+         if(shortside <= 0 || longside/shortside < profile.min_aspect ||
+            longside/shortside > profile.max_aspect)
+            return LIPREC_REJECT_ASPECT;
+         if(area < profile.min_fill*longside*shortside)
+            return LIPREC_REJECT_FILL;
+         cv::approxPolyDP(cv::Mat(contour), results,
+               cv::arcLength(cv::Mat(contour),1)*perimeter_constant,1);
+         if (results.size() != 4 || !cv::isContourConvex(results))
+            return LIPREC_REJECT_POLYGON;
+         return FILTER_PASSED;
+      }
+
+      const std::vector< std::vector<cv::Point> > &contours;
+      size_t count;                   // the contours of the frame, first ones
+      std::vector<unsigned char> &verdicts;
+      std::vector< std::vector<cv::Point> > &approx;
+      int chunks;
+      double min_area, max_area, min_perimeter;
+      const PlateProfile &profile;
+      float perimeter_constant;
+};
+
+
+void LiPRec::_findCandidates(const cv::Mat &img, const cv::Mat &optimizedimage,
+                             FrameCandidates *candidates, int min_area, int max_area,
+                             Workspace *w) const
 {
    #ifdef __DEBUG
-   std::cout << "LiPRec detectPlates real\n";
+   std::cout << "LiPRec findCandidates real\n";
    #endif
    #ifdef __SHOWIMAGES
    imshow("original",img);
@@ -257,147 +1394,420 @@ void LiPRec::_detectPlates(cv::Mat &img, cv::Mat &optimizedimage, PlatesImage* p
 
 
 
-   cv::Mat edge;
+   std::fill(candidates->timing, candidates->timing+LIPREC_STAGES, 0.0);
+   double *timing = w->stats ? candidates->timing : NULL;
+
+   // the candidates are searched on a smaller pyramid level, if asked,
+   // and the areas limits follow it. Timed with the edges.
+   StageTimer edging(timing, LIPREC_STAGE_EDGE);
+   cv::Mat searchimage = optimizedimage;
+   int levels = 0;
+   while(search_level == LIPREC_SEARCH_AUTO ? searchimage.cols > LIPREC_SEARCH_AUTO_WIDTH
+                                            : levels < search_level) {
+      if(searchimage.cols < 2 || searchimage.rows < 2)
+         break;
+      cv::Mat down = w->buffer(w->level[levels%2],
+            cv::Size((searchimage.cols+1)/2, (searchimage.rows+1)/2), CV_8UC1);
+      cv::pyrDown(searchimage, down, down.size());
+      searchimage = down;
+      levels++;
+   }
+   int scale = 1 << levels;
+   double min_search = (double)min_area/(scale*scale);
+   double max_search = (double)max_area/(scale*scale);
+
+   cv::Mat edge = w->buffer(w->edge, searchimage.size(), CV_8UC1);
 
    switch(cont)
    {
       case LIPREC_CONTOUR_THRESHOLD:
-         cv::threshold( optimizedimage, edge, thr_min, thr_max, CV_THRESH_BINARY );
+         cv::threshold( searchimage, edge, thr_min, thr_max, CV_THRESH_BINARY );
          break;
 
       case LIPREC_CONTOUR_AUTOTHRESHOLD:
-         cv::adaptiveThreshold(optimizedimage, edge, thr_min, 
+         cv::adaptiveThreshold(searchimage, edge, thr_min, 
                   CV_ADAPTIVE_THRESH_GAUSSIAN_C, CV_THRESH_BINARY_INV, athr_size, 5);
          break;
 
       case LIPREC_CONTOUR_CANNY:
       default:
-         cv::Canny(optimizedimage, edge, thr_min, thr_max);
+         cv::Canny(searchimage, edge, thr_min, thr_max);
 
    }
-   img.copyTo(plates->image);
-   optimizedimage.copyTo(plates->optimizedimage);
+   edging.stop();
+   // frame sized copies only when the caller asked to keep them
+   if(retention >= LIPREC_RETAIN_FULL) {
+      img.copyTo(candidates->image);
+      optimizedimage.copyTo(candidates->optimizedimage);
+   }
    
-   std::vector< std::vector<cv::Point> > contours;
-   cv::findContours(edge, contours, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_NONE);
    #ifdef __SHOWIMAGES
    imshow("edge",edge);
    #endif
-   std::vector<double> areas(contours.size());
+   const std::vector< std::vector<cv::Point> > &contours = w->contours;
+   StageTimer contouring(timing, LIPREC_STAGE_CONTOURS);
+   size_t ncontours = w->findContours(edge);
+   contouring.stop();
+   // every contour is judged on its own, in parallel chunks, then the
+   // candidates are cropped in contour order so the result is the same
+   // as a serial search
+   StageTimer filtering(timing, LIPREC_STAGE_FILTER);
+   std::vector<unsigned char> &verdicts = w->verdicts;
+   size_t capacity = verdicts.capacity();
+   verdicts.resize(ncontours);
+   w->track(verdicts, capacity);
+   int chunks = std::max(1, std::min(cv::getNumThreads(), (int)ncontours/FILTER_CHUNK));
+   capacity = w->approx.capacity();
+   if((int)w->approx.size() < chunks)
+      w->approx.resize(chunks);
+   w->track(w->approx, capacity);
+   ContourFilter filter(contours, ncontours, verdicts, w->approx, chunks, min_search, max_search,
+                        profile, perimeter_constant);
+   if(chunks > 1)
+      cv::parallel_for_(cv::Range(0, chunks), filter);
+   else
+      filter(cv::Range(0, 1));
+   w->seen += ncontours;
+   for(size_t c = 0; c < ncontours; c++)
+      if(verdicts[c] < LIPREC_REJECT_RULES)
+         w->rejected[verdicts[c]]++;
+   filtering.stop();
+
+   candidates->count = 0;
    unsigned int i;
-   for( i = 0; i < contours.size(); i++) {
-      areas[i] = std::fabs(cv::contourArea(cv::Mat(contours[i])));
-      if(areas[i] >= min_area && areas[i] <= max_area) {
-         std::vector<cv::Point> results;
-         cv::approxPolyDP(cv::Mat(contours[i]), results, 
-               cv::arcLength(cv::Mat(contours[i]),1)*perimeter_constant,1);
-         if (results.size() == 4 && cv::isContourConvex(results)) {
-            #ifdef __DEBUG
-            std::cout << "LiPRec Possible plate found\n";
-            #endif
+   for( i = 0; i < ncontours; i++) {
+      if(verdicts[i] != FILTER_PASSED)
+         continue;
+      #ifdef __DEBUG
+      std::cout << "LiPRec Possible plate found\n";
+      #endif
+      StageTimer cropping(timing, LIPREC_STAGE_CROP);
+
+      if(ocr_input == LIPREC_OCR_INPUT_FRAME) {
+         // only the box for now, the band is made after the last one
+         cv::Rect r = cv::boundingRect(contours[i]);
+         w->nextCandidate(candidates).rect =
+            cv::Rect(r.x*scale, r.y*scale, r.width*scale, r.height*scale) &
+            cv::Rect(0, 0, optimizedimage.cols, optimizedimage.rows);
+         continue;
+      }
+
+      // the OCR crop is always taken at full resolution, so bring the
+      // contour back there if it was found on a pyramid level
+      const std::vector< std::vector<cv::Point> > *found = &contours;
+      int idx = i;
+      if(scale > 1) {
+         capacity = w->scaled.capacity();
+         w->scaled.resize(1);
+         w->track(w->scaled, capacity);
+         std::vector<cv::Point> &full = w->scaled[0];
+         capacity = full.capacity();
+         full.resize(contours[i].size());
+         w->track(full, capacity);
+         for(size_t p = 0; p < full.size(); p++)
+            full[p] = contours[i][p]*scale;
+         found = &w->scaled;
+         idx = 0;
+      }
+
+      // crop the candidate: everything is done inside its bounding box,
+      // so a candidate costs O(plate area) and not O(frame area)
+      cv::Rect box = cv::boundingRect(cv::Mat((*found)[idx])) &
+                     cv::Rect(0, 0, optimizedimage.cols, optimizedimage.rows);
+      cv::Mat ocrimg = w->buffer(w->ocrimg, box.size(), CV_8UC1);
+      cv::Mat mask = w->buffer(w->mask, box.size(), CV_8UC1);
+      cv::Mat patch = w->buffer(w->patch, box.size(), CV_8UC1);
+      cv::Mat crop = w->buffer(w->crop, box.size(), CV_8UC1);
+      cropCandidate(optimizedimage, *found, idx, box, mask, patch, crop, ocrimg);
+
+      // the OCR runs after all the candidates are found, so the
+      // image is kept in the candidate own buffer
+      Candidate &candidate = w->nextCandidate(candidates);
+      candidate.rect = box;
+      // we need to resize the image for the OCR...
+      if(ocrimg.rows < 150) {
+         int scalefactor = 150/ocrimg.rows;
+         candidate.ocrimage = w->buffer(candidate.store,
+               cv::Size(ocrimg.cols*scalefactor, ocrimg.rows*scalefactor), CV_8UC1);
+         cv::resize(ocrimg, candidate.ocrimage, candidate.ocrimage.size(), 0, 0, CV_INTER_CUBIC);
+      } else {
+         candidate.ocrimage = w->buffer(candidate.store, ocrimg.size(), CV_8UC1);
+         ocrimg.copyTo(candidate.ocrimage);
+      }
+      ocrimg = candidate.ocrimage;
+      cropping.stop();
+      // and then get a thresholded image to pass to OCR..
+      StageTimer thresholding(timing, LIPREC_STAGE_PLATE);
+      binarizePlate(ocrimg, ocrimg);
+      thresholding.stop();
+      // NOTE: using OCR this way make the library work
+      // only with plates that uses occidental english alphabet and arabic numbers...
+      #ifdef __SHOWIMAGES
+         imshow("ocr",ocrimg);
+      #endif
+   }
+   if(ocr_input == LIPREC_OCR_INPUT_FRAME)
+      _bandCandidates(optimizedimage, candidates, w, timing);
+}
+
+void LiPRec::binarizePlate(const cv::Mat &img, cv::Mat &out) const
+{
+   switch(pcont)
+   {
+      case LIPREC_PLATECON_AUTOTHRESHOLD:
+         cv::adaptiveThreshold(img, out, thrp_min, 
+             CV_ADAPTIVE_THRESH_GAUSSIAN_C, CV_THRESH_BINARY, athrp_size, 5);
+         break;
+
+      case LIPREC_PLATECON_CANNY:
+         cv::Canny(img, out, thrp_min, thrp_max);                 
+         break;
+
+      case LIPREC_PLATECON_THRESHOLD:
+      default:
+         cv::threshold(img, out, thrp_min, thrp_max, CV_THRESH_BINARY );
+   }
+}
+
+// Last Candidate::band given. Ids are unique in the process: the frame
+// candidates of a context may be recognized by the engines of another one.
+static std::atomic<long> lastBand(0);
+
+// LIPREC_OCR_INPUT_FRAME: the rows of the frame spanned by the candidates
+// are binarized once, in the frame candidates own buffer, and every
+// candidate image is a rectangle of that band
+void LiPRec::_bandCandidates(const cv::Mat &optimizedimage, FrameCandidates *candidates,
+                             Workspace *w, double *timing) const
+{
+   if(candidates->count == 0)
+      return;
+   StageTimer thresholding(timing, LIPREC_STAGE_PLATE);
+   int top = optimizedimage.rows, bottom = 0;
+   for(size_t c = 0; c < candidates->count; c++) {
+      const cv::Rect &r = candidates->candidates[c].rect;
+      top = std::min(top, r.y);
+      bottom = std::max(bottom, r.y + r.height);
+   }
+   if(bottom <= top) {
+      // only empty boxes, nothing to read
+      candidates->count = 0;
+      return;
+   }
+   cv::Mat band = w->buffer(candidates->bandstore, cv::Size(optimizedimage.cols, bottom-top),
+                            CV_8UC1);
+   binarizePlate(optimizedimage.rowRange(top, bottom), band);
+   long id = ++lastBand;
+   for(size_t c = 0; c < candidates->count; c++) {
+      Candidate &candidate = candidates->candidates[c];
+      candidate.ocrimage = band(candidate.rect - cv::Point(0, top));
+      candidate.band = id;
+   }
+}
+
+
+void LiPRec::_recognizeCandidates(FrameCandidates *candidates, PlatesImage* plates,
+                                  OCRPool *pool, StageStats *stats) const
+{
+   plates->frame = candidates->frame;
+   if(retention >= LIPREC_RETAIN_FULL) {
+      candidates->image.copyTo(plates->image);
+      candidates->optimizedimage.copyTo(plates->optimizedimage);
+      candidates->image.copyTo(plates->contours);
+   }
 
-            // Prepare a mask image
-            cv::Mat mask = cv::Mat::zeros(img.rows, img.cols, CV_8UC1);  
-            // draw the contours filled on the mask
-            cv::drawContours(mask, contours, i, cv::Scalar(255,255,255), CV_FILLED);
-            // draw contours on the optimized image  to remove external lines
-            cv::drawContours(optimizedimage, contours, i, cv::Scalar(255,255,255), 2, 2);
-            // get rectangle of the possible plate
-            cv::Rect box = cv::boundingRect(cv::Mat(contours[i]));
-            // prepare a new image to copy the masked rectangle
-            cv::Mat crop(img.rows, img.cols, CV_8UC1);
-            crop.setTo(cv::Scalar(0));
-            // copy the masked rectangle
-            optimizedimage.copyTo(crop, mask);
-
-            #ifdef __SHOWIMAGES
-              imshow("optimized",optimizedimage);
-              imshow("crop", crop);
+   // recognize all the candidates of the frame at once, in parallel if
+   // there is more than one OCR worker
+   pool->recognize(candidates->candidates, candidates->count,
+                   stats ? candidates->timing : NULL);
+   if(stats)
+      stats->add(candidates->timing);
+
+   for(size_t i = 0; i < candidates->count; i++) {
+      const Candidate &candidate = candidates->candidates[i];
+      if(candidate.text.size() > 0 && candidate.confidence>=min_confidence) {
+         cv::String clean_text;
+         clean_text = Filter(candidate.text);
+         if(clean_text.size() > 0)
+         {
+
+            // Hey! maybe we have a plate!
+            // With a PlateFormat set the OCR engines already decoded the
+            // text to a valid plate, or left it empty.
+            // XXX TODO: a database of the plate schemas used around the
+            //           world, to pick the format by country.
+         
+            #ifdef __DEBUG
+            std::cout << "LiPRec FOUND PLATE: " << clean_text << std::endl;
+            std::cout << "Confidence level: " << candidate.confidence << std::endl;
+            std::cout << "PLATE lenght: " << clean_text.size() << std::endl;
+               #ifdef __SHOWIMAGES
+               cv::waitKey();
+               #endif
             #endif
 
-            // back to the original optimized, so, we dont get the white contour
-            plates->optimizedimage.copyTo(optimizedimage);
-
-            // set the region of interest where the masked rectangle is
-            cv::Mat roi(crop, box);
-            // prepare an image for the OCR with size equal to the rectangle
-            cv::Mat ocrimg(roi.rows, roi.cols, CV_8UC1);
-            ocrimg.setTo(cv::Scalar(255));
-            roi.copyTo(ocrimg, roi);
-            // we need to resize the image for the OCR...
-            if(ocrimg.rows < 150) {
-               int scalefactor = 150/ocrimg.rows;
-               cv::resize(ocrimg, ocrimg, cv::Size(0,0), scalefactor, scalefactor, CV_INTER_CUBIC);
-            }
-            // and then get a thresholded image to pass to OCR..
-            switch(pcont)
-            {
-               case LIPREC_PLATECON_AUTOTHRESHOLD:
-                  cv::adaptiveThreshold(ocrimg, ocrimg, thrp_min, 
-                      CV_ADAPTIVE_THRESH_GAUSSIAN_C, CV_THRESH_BINARY, athrp_size, 5);
-                  break;
-
-               case LIPREC_PLATECON_CANNY:
-                  cv::Canny(ocrimg, ocrimg, thrp_min, thrp_max);                 
-                  break;
-      
-               case LIPREC_PLATECON_THRESHOLD:
-               default:
-                  cv::threshold(ocrimg, ocrimg, thrp_min, thrp_max, CV_THRESH_BINARY );
+            Plate plate;
+            plate.rect = candidate.rect;
+            plate.platetxt = clean_text;
+            plate.confidence = candidate.confidence;
+            plate.confidences = candidate.confidences;
+            if(retention >= LIPREC_RETAIN_OCRIMAGE)
+               candidate.ocrimage.copyTo(plate.ocrimage);
+            if(retention >= LIPREC_RETAIN_FULL) {
+               plate.render(candidates->image, plate.contours);
+               rectangle(plates->contours, candidate.rect, cv::Scalar(0,0,255), 3);
             }
-            // NOTE: using OCR this way make the library work
-            // only with plates that uses occidental english alphabet and arabic numbers...
-            #ifdef __SHOWIMAGES
-               imshow("ocr",ocrimg);
-               imshow("mask",mask);
-            #endif
+            plates->plates.push_back(plate);
+         }
+      }
+   }
 
-            OCR->SetImage((uchar*)ocrimg.data, ocrimg.size().width, ocrimg.size().height,
-                          ocrimg.channels(), ocrimg.step1());
-            OCR->Recognize(0);
-            // XXX Gestire il caso in cui c'e' pagetype a single char
-            char* detected_text = OCR->GetUTF8Text(); 
-            int confidence = OCR->MeanTextConf();
-            //cout << "Size text: " << strlen(detected_text) << endl;
-            if(strlen(detected_text) > 0 && confidence>=min_confidence) {
-               cv::String clean_text;
-               clean_text = Filter(cv::String(detected_text));
-               if(clean_text.size() > 0)
-               {
-
-                  // Hey! maybe we have a plate!
-                  // XXX TODO: here we need to write a parser that try to recognize
-                  //           only valid plates schemas. To do that probably
-                  //           we need also a database of various plates schema in 
-                  //           used around the world.
-               
-                  #ifdef __DEBUG
-                  std::cout << "LiPRec FOUND PLATE: " << clean_text << std::endl;
-                  std::cout << "Confidence level: " << confidence << std::endl;
-                  std::cout << "PLATE lenght: " << clean_text.size() << std::endl;
-                     #ifdef __SHOWIMAGES
-                     cv::waitKey();
-                     #endif
-                  #endif
-
-                  Plate plate;
-                  ocrimg.copyTo(plate.ocrimage);
-                  img.copyTo(plate.contours);
-                  rectangle(plate.contours, box, cv::Scalar(0,0,255), 3);
-                  plate.rect = box;
-                  plate.platetxt = clean_text;
-                  plate.confidence = confidence;
-                  plates->plates.push_back(plate);
-                  rectangle(plates->contours, box, cv::Scalar(0,0,255), 3);
-               }
-            }           
+}
+
+
+struct PlateTrack
+{
+   TrackedPlate plate;
+   cv::Point motion;        // of the box from the previous frame
+   int missed;              // frames since it was seen last
+   bool settled;            // has a confident read, the OCR is done
+   bool seen;               // in the current frame
+   std::map<std::string, std::pair<int,int> > votes;  // read -> count, best confidence
+
+   PlateTrack() : missed(0), settled(false), seen(false) { }
+};
+
+static double overlap(const cv::Rect &a, const cv::Rect &b)
+{
+   double inter = (a & b).area();
+   return inter > 0 ? inter/(a.area() + b.area() - inter) : 0;
+}
+
+PlateTracker::PlateTracker(const LiPRec &detector, int confident, double min_overlap,
+                           int max_missed)
+   : min_confidence(detector.min_confidence), confident(confident), max_missed(max_missed),
+     min_overlap(min_overlap), next_id(0), runs(0), skipped(0)
+{
+}
+
+PlateTracker::~PlateTracker()
+{
+   for(size_t t=0;t<tracks.size();t++)
+      delete tracks[t];
+}
+
+void PlateTracker::match(FrameCandidates *candidates)
+{
+   #ifdef __DEBUG
+   std::cout << "PlateTracker match\n";
+   #endif
+
+   assigned.assign(candidates->count, -1);
+   for(size_t t=0;t<tracks.size();t++)
+      tracks[t]->seen = false;
+
+   for(size_t i=0;i<candidates->count;i++) {
+      Candidate &candidate = candidates->candidates[i];
+      double best = min_overlap;
+      for(size_t t=0;t<tracks.size();t++) {
+         if(tracks[t]->seen)
+            continue;
+         // where the box should be now, if it keeps moving the same way
+         double o = overlap(candidate.rect, tracks[t]->plate.rect + tracks[t]->motion);
+         if(o >= best) {
+            best = o;
+            assigned[i] = (int)t;
          }
       }
+      if(assigned[i] < 0) {
+         runs++;
+         continue;
+      }
+      PlateTrack *track = tracks[assigned[i]];
+      track->seen = true;
+      if(track->settled) {
+         candidate.skip = true;
+         candidate.text = track->plate.platetxt;
+         candidate.confidence = track->plate.confidence;
+         skipped++;
+      } else
+         runs++;
+   }
+}
+
+void PlateTracker::update(const FrameCandidates &candidates, std::vector<TrackedPlate> &finished)
+{
+   #ifdef __DEBUG
+   std::cout << "PlateTracker update\n";
+   #endif
+
+   size_t old = tracks.size();
+   for(size_t i=0;i<candidates.count;i++) {
+      const Candidate &candidate = candidates.candidates[i];
+      PlateTrack *track;
+      if(i < assigned.size() && assigned[i] >= 0) {
+         track = tracks[assigned[i]];
+         track->motion = candidate.rect.tl() - track->plate.rect.tl();
+      } else {
+         track = new PlateTrack();
+         track->plate.id = ++next_id;
+         track->plate.first = candidates.frame;
+         tracks.push_back(track);
+      }
+      track->plate.rect = candidate.rect;
+      track->plate.last = candidates.frame;
+      track->missed = 0;
+      track->seen = true;
+      if(candidate.skip)
+         continue;
+
+      cv::String clean_text = Filter(candidate.text);
+      if(clean_text.size() == 0 || candidate.confidence < min_confidence)
+         continue;
+      std::pair<int,int> &vote = track->votes[clean_text];
+      vote.first++;
+      vote.second = std::max(vote.second, candidate.confidence);
+      track->plate.reads++;
+      if(vote.first > track->plate.votes ||
+         (vote.first == track->plate.votes && vote.second > track->plate.confidence)) {
+         track->plate.platetxt = clean_text;
+         track->plate.votes = vote.first;
+         track->plate.confidence = vote.second;
+      }
+      if(candidate.confidence >= confident)
+         track->settled = true;
    }
+   assigned.clear();
 
+   for(size_t t=old;t-- > 0;) {
+      if(!tracks[t]->seen && ++tracks[t]->missed > max_missed)
+         close(t, finished);
+   }
 }
 
+void PlateTracker::flush(std::vector<TrackedPlate> &finished)
+{
+   while(!tracks.empty())
+      close(0, finished);
+}
 
+void PlateTracker::close(size_t t, std::vector<TrackedPlate> &finished)
+{
+   if(tracks[t]->plate.reads > 0)
+      finished.push_back(tracks[t]->plate);
+   delete tracks[t];
+   tracks.erase(tracks.begin()+t);
+}
 
-} // end namespace liprec
+unsigned long PlateTracker::ocrRuns() const
+{
+   return runs;
+}
+
+unsigned long PlateTracker::ocrSkipped() const
+{
+   return skipped;
+}
 
+
+
+} // end namespace liprec
@@ -0,0 +1,201 @@
+/***********************************************************************
+    This file is part of LiPRec, License Plate REcognition.
+
+    Copyright (C) 2012 Franco (nextime) Lanza <nextime@nexlab.it>
+
+    LiPRec is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LiPRec is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with LiPRec.  If not, see <http://www.gnu.org/licenses/>.
+************************************************************************/
+
+#include "liprec.h"
+#include <vector>
+#include <string>
+#include <algorithm>
+
+
+namespace liprec
+{
+
+
+// Symbol classes, the columns of the transition table
+#define CLASS_LETTER     (0)
+#define CLASS_DIGIT      (1)
+#define CLASSES          (2)
+#define CLASS_NONE       (-1)
+
+// A symbol the OCR put in but no format has room for costs this much
+#define SKIP_PENALTY     (10.0f)
+// Read as its look-alike of the other class it keeps this much confidence
+#define SWAP_FACTOR      (0.8f)
+
+
+static int symbolClass(char c)
+{
+   if(c >= 'A' && c <= 'Z')
+      return CLASS_LETTER;
+   if(c >= '0' && c <= '9')
+      return CLASS_DIGIT;
+   return CLASS_NONE;
+}
+
+// The letter a digit is usually mistaken for and the other way round, 0
+// if none
+static char lookAlike(char c)
+{
+   static const char digits[]  = "012568";
+   static const char letters[] = "OIZSGB";
+   for(int i=0;digits[i];i++) {
+      if(c == digits[i])
+         return letters[i];
+      if(c == letters[i])
+         return digits[i];
+   }
+   return 0;
+}
+
+
+PlateFormat::PlateFormat(const std::string &patterns)
+{
+   std::string pattern;
+   for(size_t i=0;i<=patterns.size();i++) {
+      if(i == patterns.size() || patterns[i] == '|') {
+         if(!pattern.empty())
+            add(pattern, 0, 0);
+         pattern.clear();
+      } else if(patterns[i] == 'L' || patterns[i] == 'N' || patterns[i] == 'A')
+         pattern += patterns[i];
+   }
+}
+
+int PlateFormat::state()
+{
+   table.insert(table.end(), CLASSES, -1);
+   accepting.push_back(false);
+   return accepting.size()-1;
+}
+
+// Trie of the class sequences: A goes down both branches
+void PlateFormat::add(const std::string &pattern, size_t pos, int from)
+{
+   if(accepting.empty())
+      state();
+   if(pos == pattern.size()) {
+      accepting[from] = true;
+      return;
+   }
+   for(int k=0;k<CLASSES;k++) {
+      if(pattern[pos] == 'L' && k != CLASS_LETTER)
+         continue;
+      if(pattern[pos] == 'N' && k != CLASS_DIGIT)
+         continue;
+      if(table[from*CLASSES+k] < 0) {
+         int to = state();
+         table[from*CLASSES+k] = to;
+      }
+      add(pattern, pos+1, table[from*CLASSES+k]);
+   }
+}
+
+bool PlateFormat::empty() const
+{
+   return accepting.empty();
+}
+
+bool PlateFormat::matches(const std::string &text) const
+{
+   if(empty())
+      return true;
+   int s = 0;
+   for(size_t i=0;i<text.size() && s >= 0;i++) {
+      int k = symbolClass(text[i]);
+      s = k == CLASS_NONE ? -1 : table[s*CLASSES+k];
+   }
+   return s >= 0 && accepting[s];
+}
+
+// Viterbi over (symbol, automaton state): every symbol is either one of
+// its choices, possibly swapped with its look-alike, or skipped. The best
+// accepting state after the last symbol is the result.
+bool PlateFormat::decode(const std::vector<SymbolChoices> &symbols, std::string &text,
+                         int &confidence) const
+{
+   text.clear();
+   confidence = 0;
+   if(empty())
+      return false;
+
+   struct Step {
+      float score;
+      int from;      // state before this symbol
+      char symbol;   // 0 if skipped
+      float conf;
+   };
+   const int states = accepting.size();
+   const size_t n = symbols.size();
+   Step none = { -1e30f, -1, 0, 0 };
+   std::vector<Step> steps((n+1)*states, none);
+   steps[0].score = 0;
+
+   for(size_t i=0;i<n;i++)
+      for(int s=0;s<states;s++) {
+         const Step &here = steps[i*states+s];
+         if(here.score <= none.score)
+            continue;
+         Step &skip = steps[(i+1)*states+s];
+         if(here.score - SKIP_PENALTY > skip.score) {
+            Step st = { here.score - SKIP_PENALTY, s, 0, 0 };
+            skip = st;
+         }
+         const SymbolChoices &choices = symbols[i];
+         for(size_t c=0;c<choices.size();c++)
+            for(int swap=0;swap<2;swap++) {
+               char symbol = swap ? lookAlike(choices[c].symbol) : choices[c].symbol;
+               int k = symbolClass(symbol);
+               if(k == CLASS_NONE || table[s*CLASSES+k] < 0)
+                  continue;
+               float conf = choices[c].confidence*(swap ? SWAP_FACTOR : 1.0f);
+               Step &next = steps[(i+1)*states+table[s*CLASSES+k]];
+               if(here.score + conf > next.score) {
+                  Step st = { here.score + conf, s, symbol, conf };
+                  next = st;
+               }
+            }
+      }
+
+   int best = -1;
+   for(int s=0;s<states;s++)
+      if(accepting[s] && steps[n*states+s].score > none.score &&
+         (best < 0 || steps[n*states+s].score > steps[n*states+best].score))
+         best = s;
+   if(best < 0)
+      return false;
+
+   float sum = 0;
+   for(size_t i=n, s=best;i>0;i--) {
+      const Step &st = steps[i*states+s];
+      if(st.symbol) {
+         text += st.symbol;
+         sum += st.conf;
+      }
+      s = st.from;
+   }
+   std::reverse(text.begin(), text.end());
+   if(text.empty())
+      return false;
+   confidence = (int)(sum/text.size() + 0.5);
+   return true;
+}
+
+
+
+} // end namespace liprec
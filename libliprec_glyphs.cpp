@@ -0,0 +1,179 @@
+/***********************************************************************
+    This file is part of LiPRec, License Plate REcognition.
+
+    Copyright (C) 2012 Franco (nextime) Lanza <nextime@nexlab.it>
+
+    LiPRec is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LiPRec is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with LiPRec.  If not, see <http://www.gnu.org/licenses/>.
+************************************************************************/
+
+#include "liprec.h"
+#include <vector>
+#include <algorithm>
+#include "opencv2/opencv.hpp"
+
+
+namespace liprec
+{
+
+
+// Glyphs are compared scaled to this cell, keeping their aspect ratio
+#define GLYPH_WIDTH       (16)
+#define GLYPH_HEIGHT      (24)
+// Characters are between these fractions of the plate image height
+#define GLYPH_MIN_HEIGHT  (0.3)
+#define GLYPH_MAX_HEIGHT  (0.95)
+// and no wider than this fraction of their own height
+#define GLYPH_MAX_ASPECT  (1.2)
+// ...and at least this high compared to the tallest character found
+#define GLYPH_MIN_RELATIVE (0.7)
+
+static const char glyphSymbols[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+
+// A glyph as a row of GLYPH_WIDTH*GLYPH_HEIGHT floats with zero mean and
+// unit norm, so the dot product of two of them is their correlation.
+// mask has the glyph pixels not zero and nothing else.
+static void normalizeGlyph(const cv::Mat &mask, cv::Mat &row)
+{
+   cv::Mat cell = cv::Mat::zeros(GLYPH_HEIGHT, GLYPH_WIDTH, CV_8UC1);
+   if(mask.rows > 0 && mask.cols > 0) {
+      double scale = std::min((double)GLYPH_HEIGHT/mask.rows, (double)GLYPH_WIDTH/mask.cols);
+      int w = std::max(1, (int)(mask.cols*scale + 0.5));
+      int h = std::max(1, (int)(mask.rows*scale + 0.5));
+      cv::Mat fit = cell(cv::Rect((GLYPH_WIDTH-w)/2, (GLYPH_HEIGHT-h)/2, w, h));
+      cv::resize(mask, fit, fit.size(), 0, 0, cv::INTER_AREA);
+   }
+   cell.reshape(1, 1).convertTo(row, CV_32F, 1/255.0);
+   row -= cv::mean(row)[0];
+   double n = cv::norm(row);
+   if(n > 0)
+      row /= n;
+}
+
+// Crop of the glyph pixels of a dark on light image
+static cv::Mat glyphMask(const cv::Mat &glyph)
+{
+   cv::Mat mask;
+   cv::threshold(glyph, mask, 127, 255, CV_THRESH_BINARY_INV);
+   std::vector<cv::Point> points;
+   cv::findNonZero(mask, points);
+   if(points.empty())
+      return cv::Mat();
+   return mask(cv::boundingRect(points));
+}
+
+
+GlyphRecognizer::GlyphRecognizer()
+{
+   // sans serif faces at some weights, close enough to the plate fonts to
+   // start with: train() adds real samples
+   const int fonts[] = { cv::FONT_HERSHEY_SIMPLEX, cv::FONT_HERSHEY_DUPLEX };
+   const int weights[] = { 2, 3, 4 };
+   for(unsigned int f=0;f<sizeof(fonts)/sizeof(fonts[0]);f++)
+      for(unsigned int w=0;w<sizeof(weights)/sizeof(weights[0]);w++)
+         for(const char *s=glyphSymbols;*s;s++) {
+            cv::Mat canvas(64, 64, CV_8UC1, cv::Scalar(255));
+            cv::putText(canvas, cv::String(1, *s), cv::Point(8, 52), fonts[f], 1.6,
+                        cv::Scalar(0), weights[w]);
+            cv::Mat mask = glyphMask(canvas);
+            if(!mask.empty())
+               add(mask, *s);
+         }
+}
+
+void GlyphRecognizer::train(const cv::Mat &glyph, char symbol)
+{
+   cv::Mat grey = glyph;
+   if(glyph.channels() != 1)
+      cv::cvtColor(glyph, grey, CV_RGB2GRAY);
+   cv::Mat mask = glyphMask(grey);
+   if(!mask.empty())
+      add(mask, symbol);
+}
+
+int GlyphRecognizer::size() const
+{
+   return templates.rows;
+}
+
+void GlyphRecognizer::add(const cv::Mat &mask, char symbol)
+{
+   cv::Mat row;
+   normalizeGlyph(mask, row);
+   templates.push_back(row);
+   symbols.push_back(symbol);
+}
+
+char GlyphRecognizer::classify(const cv::Mat &mask, int &confidence) const
+{
+   cv::Mat row, scores;
+   normalizeGlyph(mask, row);
+   // the correlation with every template at once
+   cv::gemm(templates, row, 1, cv::Mat(), 0, scores, cv::GEMM_2_T);
+   cv::Point best;
+   double score;
+   cv::minMaxLoc(scores, NULL, &score, NULL, &best);
+   confidence = (int)(std::max(0.0, score)*100 + 0.5);
+   return symbols[best.y];
+}
+
+
+static bool leftOf(const cv::Rect &a, const cv::Rect &b)
+{
+   return a.x < b.x;
+}
+
+cv::String GlyphRecognizer::recognize(const cv::Mat &plate, std::vector<int> *confidences) const
+{
+   if(confidences)
+      confidences->clear();
+   if(plate.empty() || templates.empty())
+      return cv::String();
+
+   // the characters are the dark pixels on a light plate, or the other way
+   // round if the plate is mostly dark
+   cv::Mat ink, contour_ink;
+   bool light = cv::mean(plate)[0] > 127;
+   cv::threshold(plate, ink, 127, 255, light ? CV_THRESH_BINARY_INV : CV_THRESH_BINARY);
+   ink.copyTo(contour_ink);
+   std::vector< std::vector<cv::Point> > blobs;
+   cv::findContours(contour_ink, blobs, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_SIMPLE);
+
+   std::vector<cv::Rect> boxes;
+   int tallest = 0;
+   for(unsigned int i=0;i<blobs.size();i++) {
+      cv::Rect r = cv::boundingRect(blobs[i]);
+      if(r.height < plate.rows*GLYPH_MIN_HEIGHT || r.height > plate.rows*GLYPH_MAX_HEIGHT ||
+         r.width > r.height*GLYPH_MAX_ASPECT)
+         continue;
+      boxes.push_back(r);
+      tallest = std::max(tallest, r.height);
+   }
+   std::sort(boxes.begin(), boxes.end(), leftOf);
+
+   cv::String text;
+   for(unsigned int i=0;i<boxes.size();i++) {
+      if(boxes[i].height < tallest*GLYPH_MIN_RELATIVE)
+         continue;
+      int confidence;
+      text += classify(ink(boxes[i]), confidence);
+      if(confidences)
+         confidences->push_back(confidence);
+   }
+   return text;
+}
+
+
+
+} // end namespace liprec
@@ -0,0 +1,414 @@
+/***********************************************************************
+    This file is part of LiPRec, License Plate REcognition.
+
+    Copyright (C) 2012 Franco (nextime) Lanza <nextime@nexlab.it>
+
+    LiPRec is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LiPRec is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with LiPRec.  If not, see <http://www.gnu.org/licenses/>.
+************************************************************************/
+
+#include "liprec.h"
+#include <vector>
+#include <algorithm>
+#include "opencv2/opencv.hpp"
+#ifdef __SSE2__
+   #include <emmintrin.h>
+#endif
+// The SSSE3 code is built whatever the target flags and chosen when the
+// CPU running it has SSSE3
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+   #include <tmmintrin.h>
+   #define KERNELS_SSSE3
+#endif
+
+
+namespace liprec
+{
+
+
+// Same fixed point coefficients cvtColor uses for CV_RGB2GRAY
+#define GREY_SHIFT   (14)
+#define GREY_R       (4899)
+#define GREY_G       (9617)
+#define GREY_B       (1868)
+
+
+static inline int reflect101(int p, int n)
+{
+   if(n == 1)
+      return 0;
+   while(p < 0 || p >= n)
+      p = p < 0 ? -p : 2*n-2-p;
+   return p;
+}
+
+
+static void greyRow(const uchar *src, int cn, uchar *dst, int width)
+{
+   for(int x=0;x<width;x++, src+=cn)
+      dst[x] = (uchar)((src[0]*GREY_R + src[1]*GREY_G + src[2]*GREY_B +
+                        (1 << (GREY_SHIFT-1))) >> GREY_SHIFT);
+}
+
+
+#ifdef KERNELS_SSSE3
+// The 3 channel valueRow: the max of each byte with the next two leaves
+// the value of pixel i in byte 3*i, then the shuffles gather 16 of them.
+// The last loads read 2 bytes past the 16 pixels, so stop one pixel early.
+// Returns the pixels done.
+__attribute__((target("ssse3")))
+static int valueRow3SSSE3(const uchar *src, uchar *dst, int width)
+{
+   const __m128i s0 = _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+   const __m128i s1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1);
+   const __m128i s2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13);
+   int x=0;
+   for(; x+17 <= width; x+=16) {
+      const uchar *p = src + 3*x;
+      __m128i m[3];
+      for(int k=0;k<3;k++)
+         m[k] = _mm_max_epu8(_mm_max_epu8(_mm_loadu_si128((const __m128i*)(p+16*k)),
+                                          _mm_loadu_si128((const __m128i*)(p+16*k+1))),
+                             _mm_loadu_si128((const __m128i*)(p+16*k+2)));
+      __m128i v = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(m[0], s0), _mm_shuffle_epi8(m[1], s1)),
+                               _mm_shuffle_epi8(m[2], s2));
+      _mm_storeu_si128((__m128i*)(dst+x), v);
+   }
+   return x;
+}
+
+static const bool haveSSSE3 = cv::checkHardwareSupport(CV_CPU_SSSE3);
+#endif
+
+
+// The V channel of CV_RGB2HSV: on 8 bit images it is just max(R,G,B)
+static void valueRow(const uchar *src, int cn, uchar *dst, int width)
+{
+   int x=0;
+   if(cn == 4) {
+      #ifdef __SSE2__
+      const __m128i lo = _mm_set1_epi32(0xff);
+      for(; x+8 <= width; x+=8) {
+         __m128i p[2];
+         for(int h=0;h<2;h++) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(src+4*(x+4*h)));
+            v = _mm_max_epu8(_mm_max_epu8(v, _mm_srli_epi32(v, 8)), _mm_srli_epi32(v, 16));
+            p[h] = _mm_and_si128(v, lo);
+         }
+         __m128i packed = _mm_packs_epi32(p[0], p[1]);
+         _mm_storel_epi64((__m128i*)(dst+x), _mm_packus_epi16(packed, packed));
+      }
+      #endif
+   } else {
+      #ifdef KERNELS_SSSE3
+      if(haveSSSE3)
+         x = valueRow3SSSE3(src, dst, width);
+      #endif
+   }
+   for(src+=x*cn; x<width; x++, src+=cn)
+      dst[x] = std::max(std::max(src[0], src[1]), src[2]);
+}
+
+
+// Erosion and dilation of row with the 3x3 ellipse (a cross) ignoring
+// the pixels outside the image, like morphologyEx does: up and down are
+// NULL on the first and last row.
+static void erodeDilateRow(const uchar *up, const uchar *row, const uchar *down,
+                           uchar *ero, uchar *dil, int width)
+{
+   if(up == NULL)
+      up = row;
+   if(down == NULL)
+      down = row;
+   if(width == 1) {
+      ero[0] = std::min(std::min(up[0], down[0]), row[0]);
+      dil[0] = std::max(std::max(up[0], down[0]), row[0]);
+      return;
+   }
+   ero[0] = std::min(std::min(up[0], down[0]), std::min(row[0], row[1]));
+   dil[0] = std::max(std::max(up[0], down[0]), std::max(row[0], row[1]));
+   int x=1;
+   #ifdef __SSE2__
+   for(; x+16 < width; x+=16) {
+      __m128i u = _mm_loadu_si128((const __m128i*)(up+x));
+      __m128i d = _mm_loadu_si128((const __m128i*)(down+x));
+      __m128i l = _mm_loadu_si128((const __m128i*)(row+x-1));
+      __m128i c = _mm_loadu_si128((const __m128i*)(row+x));
+      __m128i r = _mm_loadu_si128((const __m128i*)(row+x+1));
+      __m128i mn = _mm_min_epu8(_mm_min_epu8(u, d), _mm_min_epu8(_mm_min_epu8(l, r), c));
+      __m128i mx = _mm_max_epu8(_mm_max_epu8(u, d), _mm_max_epu8(_mm_max_epu8(l, r), c));
+      _mm_storeu_si128((__m128i*)(ero+x), mn);
+      _mm_storeu_si128((__m128i*)(dil+x), mx);
+   }
+   #endif
+   for(; x<width-1; x++) {
+      ero[x] = std::min(std::min(up[x], down[x]), std::min(std::min(row[x-1], row[x+1]), row[x]));
+      dil[x] = std::max(std::max(up[x], down[x]), std::max(std::max(row[x-1], row[x+1]), row[x]));
+   }
+   ero[x] = std::min(std::min(up[x], down[x]), std::min(row[x-1], row[x]));
+   dil[x] = std::max(std::max(up[x], down[x]), std::max(row[x-1], row[x]));
+}
+
+
+static inline uchar contrast(int grey, int opened, int closed)
+{
+   int s1 = std::min(255, grey + std::max(0, grey-opened));
+   return (uchar)std::max(0, s1 - std::max(0, closed-grey));
+}
+
+
+// The contrast step of maximizeContrast on a row:
+//    opened = dilate(eroded), closed = erode(dilated)
+//    out = (grey + (grey - opened)) - (closed - grey), all saturated
+static void contrastRow(const uchar *grey,
+                        const uchar *eu, const uchar *e, const uchar *ed,
+                        const uchar *du, const uchar *d, const uchar *dd,
+                        uchar *out, int width)
+{
+   if(eu == NULL) { eu = e; du = d; }
+   if(ed == NULL) { ed = e; dd = d; }
+   int x=0;
+   if(width > 1) {
+      uchar o = std::max(std::max(eu[0], ed[0]), std::max(e[0], e[1]));
+      uchar c = std::min(std::min(du[0], dd[0]), std::min(d[0], d[1]));
+      out[0] = contrast(grey[0], o, c);
+      x=1;
+   }
+   #ifdef __SSE2__
+   for(; x+16 < width; x+=16) {
+      __m128i o = _mm_max_epu8(
+            _mm_max_epu8(_mm_loadu_si128((const __m128i*)(eu+x)), _mm_loadu_si128((const __m128i*)(ed+x))),
+            _mm_max_epu8(_mm_max_epu8(_mm_loadu_si128((const __m128i*)(e+x-1)),
+                                      _mm_loadu_si128((const __m128i*)(e+x+1))),
+                         _mm_loadu_si128((const __m128i*)(e+x))));
+      __m128i c = _mm_min_epu8(
+            _mm_min_epu8(_mm_loadu_si128((const __m128i*)(du+x)), _mm_loadu_si128((const __m128i*)(dd+x))),
+            _mm_min_epu8(_mm_min_epu8(_mm_loadu_si128((const __m128i*)(d+x-1)),
+                                      _mm_loadu_si128((const __m128i*)(d+x+1))),
+                         _mm_loadu_si128((const __m128i*)(d+x))));
+      __m128i g = _mm_loadu_si128((const __m128i*)(grey+x));
+      __m128i s1 = _mm_adds_epu8(g, _mm_subs_epu8(g, o));
+      _mm_storeu_si128((__m128i*)(out+x), _mm_subs_epu8(s1, _mm_subs_epu8(c, g)));
+   }
+   #endif
+   for(; x<width; x++) {
+      int l = x > 0 ? x-1 : x;
+      int r = x < width-1 ? x+1 : x;
+      uchar o = std::max(std::max(eu[x], ed[x]), std::max(std::max(e[l], e[r]), e[x]));
+      uchar c = std::min(std::min(du[x], dd[x]), std::min(std::min(d[l], d[r]), d[x]));
+      out[x] = contrast(grey[x], o, c);
+   }
+}
+
+
+// Horizontal pass of the 5 taps symmetric gaussian, w are the fixed point
+// weights (center first). Sums are below 65536 so they fit an ushort.
+static void blurRow(const uchar *src, ushort *dst, int width, const int *w)
+{
+   int x=0;
+   for(; x<std::min(2, width); x++)
+      dst[x] = (ushort)(w[0]*src[x] +
+                        w[1]*(src[reflect101(x-1, width)] + src[reflect101(x+1, width)]) +
+                        w[2]*(src[reflect101(x-2, width)] + src[reflect101(x+2, width)]));
+   #ifdef __SSE2__
+   __m128i zero = _mm_setzero_si128();
+   __m128i w0 = _mm_set1_epi16((short)w[0]);
+   __m128i w1 = _mm_set1_epi16((short)w[1]);
+   __m128i w2 = _mm_set1_epi16((short)w[2]);
+   for(; x+10 <= width; x+=8) {
+      __m128i s0 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(src+x-2)), zero);
+      __m128i s1 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(src+x-1)), zero);
+      __m128i s2 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(src+x)), zero);
+      __m128i s3 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(src+x+1)), zero);
+      __m128i s4 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(src+x+2)), zero);
+      __m128i sum = _mm_add_epi16(_mm_mullo_epi16(s2, w0),
+                    _mm_add_epi16(_mm_mullo_epi16(_mm_add_epi16(s1, s3), w1),
+                                  _mm_mullo_epi16(_mm_add_epi16(s0, s4), w2)));
+      _mm_storeu_si128((__m128i*)(dst+x), sum);
+   }
+   #endif
+   for(; x<width-2; x++)
+      dst[x] = (ushort)(w[0]*src[x] + w[1]*(src[x-1] + src[x+1]) + w[2]*(src[x-2] + src[x+2]));
+   for(; x<width; x++)
+      dst[x] = (ushort)(w[0]*src[x] +
+                        w[1]*(src[reflect101(x-1, width)] + src[reflect101(x+1, width)]) +
+                        w[2]*(src[reflect101(x-2, width)] + src[reflect101(x+2, width)]));
+}
+
+
+// Vertical pass, rows are the 5 horizontally blurred rows around the
+// output one. Rounding is the same of the OpenCV 8 bit separable filters.
+static void blurColumn(const ushort * const *rows, uchar *dst, int width, const int *w)
+{
+   int x=0;
+   #ifdef __SSE2__
+   // all the partial sums are below 2^24 so float math is exact here
+   __m128i zero = _mm_setzero_si128();
+   __m128 w0 = _mm_set1_ps((float)w[0]);
+   __m128 w1 = _mm_set1_ps((float)w[1]);
+   __m128 w2 = _mm_set1_ps((float)w[2]);
+   __m128 half = _mm_set1_ps(32768.f);
+   __m128 scale = _mm_set1_ps(1.f/65536.f);
+   for(; x+8 <= width; x+=8) {
+      __m128i r[5];
+      for(int k=0;k<5;k++)
+         r[k] = _mm_loadu_si128((const __m128i*)(rows[k]+x));
+      __m128i res[2];
+      for(int h=0;h<2;h++) {
+         __m128 v[5];
+         for(int k=0;k<5;k++)
+            v[k] = _mm_cvtepi32_ps(h == 0 ? _mm_unpacklo_epi16(r[k], zero) : _mm_unpackhi_epi16(r[k], zero));
+         __m128 s = _mm_add_ps(_mm_mul_ps(v[2], w0),
+                    _mm_add_ps(_mm_mul_ps(_mm_add_ps(v[1], v[3]), w1),
+                               _mm_mul_ps(_mm_add_ps(v[0], v[4]), w2)));
+         res[h] = _mm_cvttps_epi32(_mm_mul_ps(_mm_add_ps(s, half), scale));
+      }
+      __m128i packed = _mm_packs_epi32(res[0], res[1]);
+      _mm_storel_epi64((__m128i*)(dst+x), _mm_packus_epi16(packed, packed));
+   }
+   #endif
+   for(; x<width; x++) {
+      int s = w[0]*rows[2][x] + w[1]*(rows[1][x] + rows[3][x]) + w[2]*(rows[0][x] + rows[4][x]);
+      dst[x] = cv::saturate_cast<uchar>((s + (1 << 15)) >> 16);
+   }
+}
+
+
+// Process the output rows [y0, y1) streaming the input once: every stage
+// keeps only the few rows the next one needs in small ring buffers, that
+// stay in cache, and rows around the band are recomputed.
+typedef void (*SourceRow)(const uchar *src, int cn, uchar *dst, int width);
+
+static void deepBand(const cv::Mat &src, cv::Mat &dst, int y0, int y1, const int *w,
+                     SourceRow source)
+{
+   const int rows = src.rows, width = src.cols, cn = src.channels();
+   const size_t stride = (width + 15) & ~15;
+   static thread_local std::vector<uchar> scratch;
+   size_t need = stride*(3+3+3+1) + stride*5*sizeof(ushort) + 16;
+   if(scratch.size() < need)
+      scratch.resize(need);
+   uchar *base = (uchar*)(((size_t)&scratch[0] + 15) & ~(size_t)15);
+   uchar *grey = base, *ero = grey + 3*stride, *dil = ero + 3*stride, *con = dil + 3*stride;
+   ushort *hor = (ushort*)(con + stride);
+
+   #define GREY(r) (grey + ((r)%3)*stride)
+   #define ERO(r)  (ero + ((r)%3)*stride)
+   #define DIL(r)  (dil + ((r)%3)*stride)
+   #define HOR(r)  (hor + ((r)%5)*stride)
+
+   int cs = std::max(0, y0-2), ce = std::min(rows, y1+2);
+   int gnext = std::max(0, cs-2), enext = std::max(0, cs-1), ynext = y0;
+   for(int r=cs;r<ce;r++) {
+      while(enext <= std::min(rows-1, r+1)) {
+         while(gnext <= std::min(rows-1, enext+1)) {
+            source(src.ptr(gnext), cn, GREY(gnext), width);
+            gnext++;
+         }
+         erodeDilateRow(enext > 0 ? GREY(enext-1) : NULL, GREY(enext),
+                        enext < rows-1 ? GREY(enext+1) : NULL, ERO(enext), DIL(enext), width);
+         enext++;
+      }
+      contrastRow(GREY(r), r > 0 ? ERO(r-1) : NULL, ERO(r), r < rows-1 ? ERO(r+1) : NULL,
+                  r > 0 ? DIL(r-1) : NULL, DIL(r), r < rows-1 ? DIL(r+1) : NULL, con, width);
+      blurRow(con, HOR(r), width, w);
+      for(; ynext < y1 && std::min(rows-1, ynext+2) <= r; ynext++) {
+         const ushort *taps[5];
+         for(int k=0;k<5;k++)
+            taps[k] = HOR(reflect101(ynext+k-2, rows));
+         blurColumn(taps, dst.ptr(ynext), width, w);
+      }
+   }
+
+   #undef GREY
+   #undef ERO
+   #undef DIL
+   #undef HOR
+}
+
+
+// GaussianBlur 5x5 sigma 5 weights, converted to fixed point as the
+// OpenCV 8 bit filters do: center, +-1, +-2
+struct GaussWeights
+{
+   int w[3];
+
+   GaussWeights()
+   {
+      cv::Mat k = cv::getGaussianKernel(5, 5, CV_32F), ik;
+      k.convertTo(ik, CV_32S, 1 << 8);
+      w[0] = ik.at<int>(2, 0);
+      w[1] = ik.at<int>(1, 0);
+      w[2] = ik.at<int>(0, 0);
+   }
+};
+
+
+class DeepBody : public cv::ParallelLoopBody
+{
+   public:
+      DeepBody(const cv::Mat &in, cv::Mat &out, int nbands, const int *weights, SourceRow row)
+         : src(in), dst(out), bands(nbands), w(weights), source(row) { }
+
+      void operator()(const cv::Range &range) const
+      {
+         for(int b=range.start;b<range.end;b++)
+            deepBand(src, dst, b*src.rows/bands, (b+1)*src.rows/bands, w, source);
+      }
+
+   private:
+      const cv::Mat &src;
+      cv::Mat &dst;
+      int bands;
+      const int *w;
+      SourceRow source;
+};
+
+
+static bool supported(const cv::Mat &inimg, const cv::Mat &outimg)
+{
+   return inimg.depth() == CV_8U && (inimg.channels() == 3 || inimg.channels() == 4) &&
+          !inimg.empty() && inimg.data != outimg.data;
+}
+
+
+bool extractValue(const cv::Mat &inimg, cv::Mat &outimg)
+{
+   if(!supported(inimg, outimg))
+      return false;
+
+   outimg.create(inimg.size(), CV_8UC1);
+   for(int y=0;y<inimg.rows;y++)
+      valueRow(inimg.ptr(y), inimg.channels(), outimg.ptr(y), inimg.cols);
+   return true;
+}
+
+
+bool fusedDeepOptimize(const cv::Mat &inimg, cv::Mat &outimg, bool value)
+{
+   if(!supported(inimg, outimg))
+      return false;
+
+   static const GaussWeights gauss;
+
+   outimg.create(inimg.size(), CV_8UC1);
+   // bands big enough that recomputing the rows around them is cheap
+   int bands = std::max(1, std::min(cv::getNumThreads(), inimg.rows/64));
+   cv::parallel_for_(cv::Range(0, bands), DeepBody(inimg, outimg, bands, gauss.w,
+                                                        value ? valueRow : greyRow));
+   return true;
+}
+
+
+
+} // end namespace liprec
@@ -20,34 +20,721 @@
 #include "opencv2/opencv.hpp"
 #include "opencv2/highgui/highgui.hpp"
 #include "optionparser.h"
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
 
 using namespace liprec;
 using namespace std;
 using namespace cv;
 
-enum  optionIndex { OPT_UNKNOWN, OPT_HELP, OPT_DEBUG, OPT_GUI, OPT_PAUSE};
+enum  optionIndex { OPT_UNKNOWN, OPT_HELP, OPT_DEBUG, OPT_GUI, OPT_PIPELINE, OPT_SEARCH, OPT_MOTION, OPT_TRACK, OPT_WORKERS, OPT_QUEUE, OPT_DROP, OPT_TIMING, OPT_COUNTRY, OPT_RECOGNIZER, OPT_CACHE, OPT_FORMAT, OPT_INPUT, OPT_PAUSE};
 const option::Descriptor usage[] =
  {
-  {OPT_UNKNOWN, 0,"", ""    ,option::Arg::None, "USAGE: liprec [options] <video_file|image_file|video uri>\n\n"
+  {OPT_UNKNOWN, 0,"", ""    ,option::Arg::None, "USAGE: liprec [options] <video_file|image_file|video uri>...\n\n"
                                                  "Options:" },
   {OPT_HELP,    0,"h","help",option::Arg::None, "  -h, --help  \tPrint usage and exit." },
   {OPT_DEBUG,   0,"d","debug",option::Arg::Optional, "  -d[level], --debug[=level]  \tSet debug level."},
   {OPT_GUI,     0,"g","gui",option::Arg::None, "  -g, --gui  \tshow graphic UI." },
+  {OPT_PIPELINE, 0,"P","pipeline",option::Arg::None, "  -P, --pipeline  \tcapture, candidate search and OCR in different threads." },
+  {OPT_SEARCH,  0,"s","search",option::Arg::Optional, "  -s[level], --search[=level]  \tsearch the plates on the frame halved level times, automatic without level." },
+  {OPT_MOTION,  0,"m","motion",option::Arg::None, "  -m, --motion  \tfixed camera: skip the frames without motion and search only the box around what changed." },
+  {OPT_TRACK,   0,"t","track",option::Arg::None, "  -t, --track  \tfollow the plates across frames, read each one until sure and print it once." },
+  {OPT_WORKERS, 0,"w","workers",option::Arg::Optional, "  -w[n], --workers[=n]  \twith more sources, detection workers shared by them (default one per source, up to the CPUs). Each one is a DetectContext, with its own OCR engine." },
+  {OPT_QUEUE,   0,"q","queue",option::Arg::Optional, "  -q[n], --queue[=n]  \tframes captured ahead of the detection (default 4)." },
+  {OPT_DROP,    0,"D","drop",option::Arg::Optional, "  -D[policy], --drop[=policy]  \twhen the queue is full: block (default), oldest or newest frame dropped. Use it with live sources." },
+  {OPT_TIMING,  0,"T","timing",option::Arg::None, "  -T, --timing  \ttime every stage of the detection and print a summary at the end." },
+  {OPT_COUNTRY, 0,"c","country",option::Arg::Optional, "  -c<country>, --country=<country>  \tshape of the plates searched: any (default), eu, us or au." },
+  {OPT_RECOGNIZER, 0,"r","recognizer",option::Arg::Optional, "  -r<engine>, --recognizer=<engine>  \tplate reader: tesseract (default) or glyphs, the faster built-in one." },
+  {OPT_CACHE,   0,"C","cache",option::Arg::Optional, "  -C[n], --cache[=n]  \treuse the OCR result of the last n (default 64) plate images for a nearly identical one." },
+  {OPT_FORMAT,  0,"f","format",option::Arg::Optional, "  -f<patterns>, --format=<patterns>  \tonly plates like patterns, separated by |: L letter, N digit, A any (e.g. -f'NNNLLL|LLNNNLL')." },
+  {OPT_INPUT,   0,"i","input",option::Arg::Optional, "  -i<input>, --input=<input>  \tOCR input: crops (default), one image per plate, or frame, one band per frame read by rectangles." },
   {OPT_PAUSE,   0,"p","",option::Arg::None, "  -p  \tpause video on plate detected\n"},
   {OPT_UNKNOWN, 0,"", ""   ,option::Arg::None, "\nExamples:\n"
                                                  "  liprec -d file1.mjpeg\n"
                                                  "  liprec http://<ip_addr>/img/video.h264\n" 
-                                                 "  liprec -g file.jpg\n" },
+                                                 "  liprec -g file.jpg\n"
+                                                 "  liprec -t rtsp://<cam1>/stream rtsp://<cam2>/stream\n" },
   {0,0,0,0,0,0}
  };
 
+// Motion gating for fixed cameras: every frame is compared, MOTION_SCALE
+// times smaller, with a slowly updated background and the plates are
+// searched only where it changed.
+#define MOTION_SCALE     (8)
+#define MOTION_THRESHOLD (25)    // grey levels
+#define MOTION_MARGIN    (3)     // small image pixels added around a change
+#define MOTION_LEARN     (0.05)  // background update rate
+
+class MotionGate
+{
+   public:
+      MotionGate() : frames(0), skipped(0), pixels(0), searched(0) { }
+
+      // Regions of frame changed from the background, in frame
+      // coordinates and not overlapping. Empty if nothing moved.
+      void changedRegions(const Mat &frame, vector<Rect> &regions)
+      {
+         regions.clear();
+         frames++;
+         pixels += frame.total();
+         cv::resize(frame, small, Size(std::max(1, frame.cols/MOTION_SCALE),
+                                       std::max(1, frame.rows/MOTION_SCALE)), 0, 0, INTER_AREA);
+         cvtColor(small, grey, CV_RGB2GRAY);
+         if(background.size() != grey.size()) {
+            // nothing to compare with yet, search everywhere
+            grey.convertTo(background, CV_32F);
+            regions.push_back(Rect(0, 0, frame.cols, frame.rows));
+            searched += frame.total();
+            return;
+         }
+         background.convertTo(still, CV_8U);
+         absdiff(grey, still, diff);
+         accumulateWeighted(grey, background, MOTION_LEARN);
+         threshold(diff, diff, MOTION_THRESHOLD, 255, CV_THRESH_BINARY);
+         dilate(diff, diff, Mat(), Point(-1,-1), MOTION_MARGIN);
+         findContours(diff, contours, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_SIMPLE);
+
+         double sx = (double)frame.cols/small.cols, sy = (double)frame.rows/small.rows;
+         Rect all(0, 0, frame.cols, frame.rows);
+         for(unsigned int i=0;i<contours.size();i++) {
+            Rect r = boundingRect(Mat(contours[i]));
+            Rect region = Rect(Point(r.x*sx, r.y*sy), Point((r.x+r.width)*sx+1, (r.y+r.height)*sy+1)) & all;
+            // merge with the regions it overlaps, until none is left
+            for(unsigned int j=0;j<regions.size();) {
+               if((regions[j] & region).area() > 0) {
+                  region |= regions[j];
+                  regions.erase(regions.begin()+j);
+                  j=0;
+               } else
+                  j++;
+            }
+            regions.push_back(region);
+         }
+
+         size_t area = 0;
+         for(unsigned int i=0;i<regions.size();i++)
+            area += regions[i].area();
+         // with most of the frame changed, a single search is cheaper
+         if(area > frame.total()/2) {
+            regions.assign(1, all);
+            area = frame.total();
+         }
+         if(regions.empty())
+            skipped++;
+         searched += area;
+      }
+
+      void report() const
+      {
+         if(frames == 0)
+            return;
+         cout << "Motion gating: skipped " << skipped << " of " << frames << " frames, "
+              << (pixels - searched) << " of " << pixels << " pixels ("
+              << 100.0*(pixels - searched)/pixels << "%)" << endl;
+      }
+
+      long frames, skipped;
+      unsigned long long pixels, searched;
+
+   private:
+      Mat small, grey, still, diff, background;
+      vector< vector<Point> > contours;
+};
+
+// Depth of the pipeline: frames being captured, searched or recognized
+#define PIPELINE_FRAMES (4)
+
+// Fixed capacity FIFO between the pipeline stages: push blocks while it
+// is full and pop while it is empty.
+template<typename T> class BoundedQueue
+{
+   public:
+      BoundedQueue(size_t size) : capacity(size) { }
+
+      void push(const T &item)
+      {
+         std::unique_lock<std::mutex> guard(lock);
+         while(items.size() >= capacity)
+            not_full.wait(guard);
+         items.push_back(item);
+         not_empty.notify_one();
+      }
+
+      T pop()
+      {
+         std::unique_lock<std::mutex> guard(lock);
+         while(items.empty())
+            not_empty.wait(guard);
+         T item = items.front();
+         items.pop_front();
+         not_full.notify_one();
+         return item;
+      }
+
+   private:
+      std::deque<T> items;
+      size_t capacity;
+      std::mutex lock;
+      std::condition_variable not_empty, not_full;
+};
+
+// A frame going through the pipeline, slots are recycled
+struct FrameSlot {
+   Mat image;
+   FrameCandidates candidates;
+};
+
+typedef BoundedQueue<FrameSlot*> SlotQueue;
+
+// What the capture does when all the frames are taken
+#define CAPTURE_BLOCK        (0)   // wait for one, the source waits too
+#define CAPTURE_DROP_OLDEST  (1)   // overwrite the oldest not yet taken
+#define CAPTURE_DROP_NEWEST  (2)   // skip the new one
+
+// Default frames of a capture ring
+#define CAPTURE_FRAMES (4)
+
+// The frames of a source, captured by their own thread into a fixed set
+// of slots allocated once. A slow detection never stalls the decoding:
+// with a drop policy the capture always keeps up with a live source and
+// the latency stays bounded by the ring size.
+class CaptureRing
+{
+   public:
+      CaptureRing(VideoCapture *source, int frames=CAPTURE_FRAMES, int drop=CAPTURE_BLOCK)
+         : captured(0), dropped(0), max_depth(0), depth_sum(0), pops(0),
+           cap(source), policy(drop), size(std::max(1, frames)), ended(false), stopping(false)
+      {
+         slots = new FrameSlot[size];
+         for(size_t i=0;i<size;i++)
+            free_slots.push_back(&slots[i]);
+      }
+
+      ~CaptureRing()
+      {
+         stop();
+         delete [] slots;
+      }
+
+      // Start capturing, on_frame is called every time a frame is ready
+      // and at the end of the source
+      void start(std::function<void()> on_frame = std::function<void()>())
+      {
+         notify = on_frame;
+         worker = std::thread(&CaptureRing::run, this);
+      }
+
+      // Stop capturing and forget the frames not taken yet
+      void stop()
+      {
+         {
+            std::unique_lock<std::mutex> guard(lock);
+            stopping = true;
+            while(!ready.empty()) {
+               free_slots.push_back(ready.front());
+               ready.pop_front();
+            }
+            changed.notify_all();
+         }
+         if(worker.joinable())
+            worker.join();
+      }
+
+      // Oldest frame captured, NULL at the end of the source
+      FrameSlot *pop()
+      {
+         std::unique_lock<std::mutex> guard(lock);
+         while(ready.empty() && !ended)
+            changed.wait(guard);
+         return take();
+      }
+
+      // Like pop() but never waits: NULL if there is no frame yet, with
+      // over set if the source is over too
+      FrameSlot *tryPop(bool *over)
+      {
+         std::unique_lock<std::mutex> guard(lock);
+         *over = ended && ready.empty();
+         return take();
+      }
+
+      // Give back a slot after pop()
+      void release(FrameSlot *slot)
+      {
+         std::unique_lock<std::mutex> guard(lock);
+         free_slots.push_back(slot);
+         changed.notify_all();
+      }
+
+      void report() const
+      {
+         cout << "Capture: " << captured << " frames, " << dropped << " dropped, "
+              << "queue depth " << (pops ? depth_sum/pops : 0) << " average, "
+              << max_depth << " max" << endl;
+      }
+
+      unsigned long captured, dropped;
+      size_t max_depth;         // frames waiting at most
+      double depth_sum;         // frames waiting, summed at every pop()
+      unsigned long pops;
+
+   private:
+      VideoCapture *cap;
+      int policy;
+      size_t size;
+      FrameSlot *slots;
+      std::deque<FrameSlot*> free_slots, ready;
+      bool ended, stopping;
+      std::mutex lock;
+      std::condition_variable changed;
+      std::thread worker;
+      std::function<void()> notify;
+
+      FrameSlot *take()
+      {
+         if(ready.empty())
+            return NULL;
+         depth_sum += ready.size();
+         pops++;
+         FrameSlot *slot = ready.front();
+         ready.pop_front();
+         return slot;
+      }
+
+      void run()
+      {
+         long frameno=0;
+         for(;;) {
+            FrameSlot *slot = NULL;
+            {
+               std::unique_lock<std::mutex> guard(lock);
+               while(!stopping && free_slots.empty() && policy == CAPTURE_BLOCK)
+                  changed.wait(guard);
+               if(stopping)
+                  break;
+               if(!free_slots.empty()) {
+                  slot = free_slots.front();
+                  free_slots.pop_front();
+               } else if(policy == CAPTURE_DROP_OLDEST && !ready.empty()) {
+                  slot = ready.front();
+                  ready.pop_front();
+                  dropped++;
+               }
+            }
+            if(slot == NULL) {
+               // CAPTURE_DROP_NEWEST, or all the frames are being worked on:
+               // keep the source going without decoding the frame
+               if(!cap->grab())
+                  break;
+               frameno++;
+               std::unique_lock<std::mutex> guard(lock);
+               captured++;
+               dropped++;
+               continue;
+            }
+            if(!cap->grab() || !cap->retrieve(slot->image)) {
+               release(slot);
+               break;
+            }
+            slot->candidates.frame = ++frameno;
+            {
+               std::unique_lock<std::mutex> guard(lock);
+               ready.push_back(slot);
+               captured++;
+               max_depth = std::max(max_depth, ready.size());
+               changed.notify_all();
+            }
+            if(notify)
+               notify();
+         }
+         {
+            std::unique_lock<std::mutex> guard(lock);
+            ended = true;
+            changed.notify_all();
+         }
+         if(notify)
+            notify();
+      }
+
+      CaptureRing(const CaptureRing &);               // not copyable
+      CaptureRing &operator=(const CaptureRing &);
+};
+
+// With a motion gate only the box around all the changed regions is
+// searched, a frame holds a single set of candidates. Every path, with
+// or without tracker and pipeline, gets its candidates from here.
+static void frameCandidates(LiPRec *detector, MotionGate *gate, const Mat &image,
+                            FrameCandidates *candidates, vector<Rect> &regions,
+                            DetectContext *ctx=NULL)
+{
+   Rect box(0, 0, image.cols, image.rows);
+   if(gate != NULL) {
+      gate->changedRegions(image, regions);
+      candidates->count = 0;
+      if(regions.empty())
+         return;
+      box = regions[0];
+      for(unsigned int r=1;r<regions.size();r++)
+         box |= regions[r];
+   }
+   if(ctx)
+      detector->findCandidates(image(box), candidates, *ctx);
+   else
+      detector->findCandidates(image(box), candidates);
+   for(size_t i=0;i<candidates->count;i++)
+      candidates->candidates[i].rect += box.tl();
+}
+
+// NULL is pushed downstream at the end of the video
+static void candidatesStage(LiPRec *detector, MotionGate *gate, CaptureRing *in, SlotQueue *out)
+{
+   vector<Rect> regions;
+   for(;;) {
+      FrameSlot *slot = in->pop();
+      if(slot != NULL)
+         frameCandidates(detector, gate, slot->image, &slot->candidates, regions);
+      out->push(slot);
+      if(slot == NULL)
+         return;
+   }
+}
+
+static bool printPlates(const PlatesImage &plates, bool frameno, int stream=-1)
+{
+   for(unsigned int i=0;i<plates.plates.size();i++) {
+      cout << "** Plates found: " << plates.plates[i].platetxt;
+      cout << "   (confidence:" << plates.plates[i].confidence << ")";
+      if(stream >= 0)
+         cout << "   (stream:" << stream << ")";
+      if(frameno)
+         cout << "   (frame:" << plates.frame << ")";
+      cout << endl;
+   }
+   return plates.plates.size() > 0;
+}
+
+static bool printTracks(const vector<TrackedPlate> &tracks, int stream=-1)
+{
+   for(unsigned int i=0;i<tracks.size();i++) {
+      cout << "** Plates found: " << tracks[i].platetxt;
+      cout << "   (confidence:" << tracks[i].confidence << ")";
+      if(stream >= 0)
+         cout << "   (stream:" << stream << ")";
+      cout << "   (votes:" << tracks[i].votes << "/" << tracks[i].reads << ")";
+      cout << "   (frames:" << tracks[i].first << "-" << tracks[i].last << ")";
+      cout << endl;
+   }
+   return tracks.size() > 0;
+}
+
+static void reportTiming(const StageStats *stats)
+{
+   if(stats == NULL || stats->frames == 0)
+      return;
+   cout << "Stage timing over " << stats->frames << " frames (us):" << endl;
+   for(int s=0;s<LIPREC_STAGES;s++)
+      cout << "   " << StageStats::name(s) << "\tmean " << stats->mean(s)
+           << "\tp50 <" << stats->percentile(s, 0.5)
+           << "\tp95 <" << stats->percentile(s, 0.95) << endl;
+}
+
+// detector is a LiPRec or a DetectContext
+template<class Detector> static void reportFilter(const Detector &detector)
+{
+   if(detector.contoursSeen() == 0)
+      return;
+   cout << "Contour filter: " << detector.contoursSeen() << " contours, rejected by";
+   for(int r=0;r<LIPREC_REJECT_RULES;r++)
+      cout << " " << DetectContext::rejectName(r) << " " << detector.contoursRejected(r);
+   cout << endl;
+}
+
+template<class Detector> static void reportCache(const Detector &detector)
+{
+   unsigned long hits = detector.ocrCacheHits(), misses = detector.ocrCacheMisses();
+   if(hits + misses == 0)
+      return;
+   cout << "OCR cache: " << hits << " hits, " << misses << " misses ("
+        << 100*hits/(hits+misses) << "%)" << endl;
+}
+
+static void reportTracker(PlateTracker *tracker, int stream=-1)
+{
+   if(tracker == NULL)
+      return;
+   vector<TrackedPlate> finished;
+   tracker->flush(finished);
+   printTracks(finished, stream);
+   if(stream >= 0)
+      cout << "Stream " << stream << " ";
+   cout << "Tracker: " << tracker->ocrRuns() << " candidates read, "
+        << tracker->ocrSkipped() << " skipped" << endl;
+}
+
+// Capture and candidate search run each in their own thread, connected by
+// bounded queues, while the OCR and the output are done here. The three
+// stages work on different frames at the same time, so the throughput is
+// the one of the slowest stage.
+static void runPipeline(CaptureRing &capture, LiPRec &plateDetector, MotionGate *gate,
+                        PlateTracker *tracker, int debug_level, int use_gui, int pause)
+{
+   vector<TrackedPlate> finished;
+   SlotQueue ocr(PIPELINE_FRAMES+1);
+   bool stop = false;
+   Mat shown;
+
+   capture.start();
+   std::thread candidates(candidatesStage, &plateDetector, gate, &capture, &ocr);
+
+   for(;;) {
+      FrameSlot *slot = ocr.pop();
+      if(slot == NULL)
+         break;
+      if(stop) {
+         // just drain the pipeline
+         capture.release(slot);
+         continue;
+      }
+      PlatesImage plates;
+      if(tracker)
+         tracker->match(&slot->candidates);
+      plateDetector.recognizeCandidates(&slot->candidates, &plates);
+      finished.clear();
+      if(tracker)
+         tracker->update(slot->candidates, finished);
+      if(debug_level) {
+         cout << "Frame # " << plates.frame << " plates vector size: " << plates.plates.size() << endl;
+      }
+      if(use_gui) {
+         plates.render(slot->image, shown);
+         cv::imshow("LiPRec", shown);
+      }
+      capture.release(slot);
+      if(tracker ? printTracks(finished) : printPlates(plates, true)) {
+         if(pause) {
+            if(use_gui) {
+               cv::waitKey();
+            }
+            else {
+               std::cout << "Press enter to continue: ";
+               std::cin >> pause;
+            }
+         }
+      }
+      if(debug_level>1 || use_gui) {
+         if(cv::waitKey(30) >= 0) {
+            stop=true;
+            capture.stop();
+         }
+      }
+   }
+   candidates.join();
+   if(!stop)
+      cout << "Video is over\n";
+}
+
+// A camera of a multi camera run. Its frames are detected one at a time,
+// so its motion gate and tracker see them in order.
+struct Stream {
+   int id;
+   VideoCapture cap;
+   CaptureRing *ring;
+   bool busy;
+   MotionGate gate;
+   PlateTracker *tracker;
+
+   Stream() : id(0), ring(NULL), busy(false), tracker(NULL) { }
+   ~Stream() { delete ring; delete tracker; }
+};
+
+// Hands the captured frames to the workers going round the cameras, and
+// never more than one frame of the same camera at a time: a fast camera
+// gets its turn like the others and cannot keep all the workers busy.
+class FairScheduler
+{
+   public:
+      FairScheduler(const vector<Stream*> &all) : streams(all), next(0) { }
+
+      // A camera captured a frame or is over
+      void wake()
+      {
+         std::unique_lock<std::mutex> guard(lock);
+         changed.notify_all();
+      }
+
+      // Next frame to detect and its camera, NULL when all the cameras
+      // are over
+      FrameSlot *pop(Stream **stream)
+      {
+         std::unique_lock<std::mutex> guard(lock);
+         for(;;) {
+            bool running = false;
+            for(size_t k=0;k<streams.size();k++) {
+               Stream *s = streams[(next+k)%streams.size()];
+               if(s->busy) {
+                  running = true;
+                  continue;
+               }
+               bool over;
+               FrameSlot *slot = s->ring->tryPop(&over);
+               if(slot != NULL) {
+                  s->busy = true;
+                  next = (next+k+1)%streams.size();
+                  *stream = s;
+                  return slot;
+               }
+               if(!over)
+                  running = true;
+            }
+            if(!running)
+               return NULL;
+            changed.wait(guard);
+         }
+      }
+
+      // The worker is done with the frame of stream
+      void done(Stream *stream)
+      {
+         std::unique_lock<std::mutex> guard(lock);
+         stream->busy = false;
+         changed.notify_all();
+      }
+
+   private:
+      const vector<Stream*> &streams;
+      size_t next;
+      std::mutex lock;
+      std::condition_variable changed;
+};
+
+// A worker of the pool shared by the cameras, with its own context and
+// so its own Tesseract engine
+static void streamWorker(LiPRec *detector, DetectContext *context, FairScheduler *scheduler,
+                         bool motion, std::mutex *output, int debug_level)
+{
+   DetectContext &ctx = *context;
+   vector<Rect> regions;
+   vector<TrackedPlate> finished;
+   for(;;) {
+      Stream *stream;
+      FrameSlot *slot = scheduler->pop(&stream);
+      if(slot == NULL)
+         return;
+      PlatesImage plates;
+      finished.clear();
+      frameCandidates(detector, motion ? &stream->gate : NULL, slot->image,
+                      &slot->candidates, regions, &ctx);
+      if(stream->tracker)
+         stream->tracker->match(&slot->candidates);
+      detector->recognizeCandidates(&slot->candidates, &plates, ctx);
+      if(stream->tracker)
+         stream->tracker->update(slot->candidates, finished);
+      {
+         std::lock_guard<std::mutex> guard(*output);
+         if(debug_level)
+            cout << "Stream " << stream->id << " frame # " << slot->candidates.frame
+                 << " plates vector size: " << plates.plates.size() << endl;
+         if(stream->tracker)
+            printTracks(finished, stream->id);
+         else
+            printPlates(plates, true, stream->id);
+      }
+      stream->ring->release(slot);
+      scheduler->done(stream);
+   }
+}
+
+// Every source has its own capture thread, while the detection and the
+// OCR are done by a pool of workers shared by all of them, each with its
+// own DetectContext (see there for what its OCR engine costs).
+static int runCameras(const vector<cv::String> &sources, LiPRec &plateDetector,
+                      int workers, int frames, int drop, bool motion, bool track,
+                      bool timing, int debug_level)
+{
+   vector<Stream*> streams;
+   for(unsigned int i=0;i<sources.size();i++) {
+      Stream *stream = new Stream();
+      stream->id = i;
+      if(!stream->cap.open(sources[i])) {
+         cout << "Cannot open file " << sources[i] << endl;
+         delete stream;
+         for(unsigned int s=0;s<streams.size();s++)
+            delete streams[s];
+         return -1;
+      }
+      stream->ring = new CaptureRing(&stream->cap, frames, drop);
+      if(track)
+         stream->tracker = new PlateTracker(plateDetector);
+      cout << "Stream " << i << ": " << sources[i] << endl;
+      streams.push_back(stream);
+   }
+   // with one frame per camera at a time more workers than cameras
+   // would just wait
+   if(workers <= 0)
+      workers = std::max(1, (int)std::thread::hardware_concurrency());
+   workers = std::min(workers, (int)streams.size());
+
+   FairScheduler scheduler(streams);
+   std::mutex output;
+   vector<DetectContext*> contexts;
+   vector<std::thread> threads;
+   for(int w=0;w<workers;w++) {
+      contexts.push_back(new DetectContext(plateDetector));
+      contexts.back()->setTiming(timing);
+   }
+   for(unsigned int i=0;i<streams.size();i++)
+      streams[i]->ring->start(std::bind(&FairScheduler::wake, &scheduler));
+   for(int w=0;w<workers;w++)
+      threads.push_back(std::thread(streamWorker, &plateDetector, contexts[w], &scheduler,
+                                    motion, &output, debug_level));
+   for(unsigned int t=0;t<threads.size();t++)
+      threads[t].join();
+
+   cout << "Video is over\n";
+   for(int w=0;w<workers;w++) {
+      const DetectContext &ctx = *contexts[w];
+      if(timing || ctx.ocrCacheHits() + ctx.ocrCacheMisses() > 0)
+         cout << "Worker " << w << ":" << endl;
+      if(timing) {
+         reportTiming(ctx.stageStats());
+         reportFilter(ctx);
+      }
+      reportCache(ctx);
+      delete contexts[w];
+   }
+   for(unsigned int i=0;i<streams.size();i++) {
+      reportTracker(streams[i]->tracker, streams[i]->id);
+      if(motion && streams[i]->gate.frames > 0) {
+         cout << "Stream " << streams[i]->id << " ";
+         streams[i]->gate.report();
+      }
+      cout << "Stream " << streams[i]->id << " ";
+      streams[i]->ring->report();
+      delete streams[i];
+   }
+   return 0;
+}
+
 int main(int argc, char* argv[])
 {
 
    int debug_level=0;
    int use_gui=0;
    int pause=0;
-   Mat frame;
+   int pipeline=0;
+   int motion=0;
+   int track=0;
+   int workers=0;
+   int frames=CAPTURE_FRAMES;
+   int drop=CAPTURE_BLOCK;
+   int timing=0;
+   Mat frame, shown;
+   MotionGate gate;
+   vector<Rect> regions;
+   vector<TrackedPlate> finished;
    LiPRec plateDetector;
 
    argc-=(argc>0); argv+=(argc>0); // skip program name argv[0] if present
@@ -102,9 +789,99 @@ int main(int argc, char* argv[])
          case OPT_PAUSE:
             pause=1;
             break;
+         case OPT_PIPELINE:
+            pipeline=1;
+            break;
+         case OPT_MOTION:
+            motion=1;
+            break;
+         case OPT_TRACK:
+            track=1;
+            break;
+         case OPT_WORKERS:
+            if(opt.arg)
+               workers=atoi(opt.arg);
+            break;
+         case OPT_TIMING:
+            plateDetector.setTiming();
+            timing=1;
+            break;
+         case OPT_COUNTRY:
+            if(opt.arg == NULL || string(opt.arg) == "any")
+               plateDetector.setPlateProfile(LIPREC_PLATE_ANY);
+            else if(string(opt.arg) == "eu")
+               plateDetector.setPlateProfile(LIPREC_PLATE_EU);
+            else if(string(opt.arg) == "us")
+               plateDetector.setPlateProfile(LIPREC_PLATE_US);
+            else if(string(opt.arg) == "au")
+               plateDetector.setPlateProfile(LIPREC_PLATE_AU);
+            else {
+               cout << "Unknown country " << opt.arg << endl;
+               return -1;
+            }
+            break;
+         case OPT_FORMAT:
+            if(opt.arg)
+               plateDetector.setPlateFormat(opt.arg);
+            break;
+         case OPT_INPUT:
+            if(opt.arg == NULL || string(opt.arg) == "crops")
+               plateDetector.setOCRInput(LIPREC_OCR_INPUT_CROPS);
+            else if(string(opt.arg) == "frame")
+               plateDetector.setOCRInput(LIPREC_OCR_INPUT_FRAME);
+            else {
+               cout << "Unknown OCR input " << opt.arg << endl;
+               return -1;
+            }
+            break;
+         case OPT_CACHE:
+            plateDetector.setOCRCache(opt.arg ? atoi(opt.arg) : LIPREC_CACHE_ENTRIES);
+            break;
+         case OPT_RECOGNIZER:
+            if(opt.arg == NULL || string(opt.arg) == "tesseract")
+               plateDetector.setRecognizer(LIPREC_OCR_TESSERACT);
+            else if(string(opt.arg) == "glyphs")
+               plateDetector.setRecognizer(LIPREC_OCR_GLYPHS);
+            else {
+               cout << "Unknown recognizer " << opt.arg << endl;
+               return -1;
+            }
+            break;
+         case OPT_QUEUE:
+            if(opt.arg)
+               frames=std::max(1, atoi(opt.arg));
+            break;
+         case OPT_DROP:
+            if(opt.arg == NULL || string(opt.arg) == "block")
+               drop=CAPTURE_BLOCK;
+            else if(string(opt.arg) == "oldest")
+               drop=CAPTURE_DROP_OLDEST;
+            else if(string(opt.arg) == "newest")
+               drop=CAPTURE_DROP_NEWEST;
+            else {
+               cout << "Unknown drop policy " << opt.arg << endl;
+               return -1;
+            }
+            break;
+         case OPT_SEARCH:
+            if(opt.arg)
+               plateDetector.setSearchLevel(atoi(opt.arg));
+            else
+               plateDetector.setSearchLevel(LIPREC_SEARCH_AUTO);
+            break;
       }
    }
 
+   if(parse.nonOptionsCount() > 1) {
+      if(use_gui || pause || pipeline)
+         cout << "GUI, pause and pipeline are not available with more sources\n";
+      vector<cv::String> sources;
+      for(int i=0;i<parse.nonOptionsCount();i++)
+         sources.push_back(parse.nonOption(i));
+      return runCameras(sources, plateDetector, workers, frames, drop, motion, track,
+                        timing, debug_level);
+   }
+
    //VideoCapture cap(argv[1]);
    VideoCapture cap(parse.nonOption(0));
    if(!cap.isOpened()) {
@@ -116,34 +893,65 @@ int main(int argc, char* argv[])
       cv::namedWindow("LiPRec", 0);
    }
 
+   PlateTracker *tracker = NULL;
+   if(track)
+      tracker = new PlateTracker(plateDetector);
+
+   CaptureRing capture(&cap, frames, drop);
+   if(pipeline) {
+      runPipeline(capture, plateDetector, motion ? &gate : NULL, tracker,
+                  debug_level, use_gui, pause);
+      reportTracker(tracker);
+      delete tracker;
+      gate.report();
+      capture.report();
+      reportTiming(plateDetector.stageStats());
+      if(timing)
+         reportFilter(plateDetector);
+      reportCache(plateDetector);
+      return 0;
+   }
+
+   capture.start();
+   FrameSlot *slot = NULL;
+
    for(;;) {
       //#ifdef __DEBUG
       if(debug_level) {
          imgnum++;
          cout << "Working in frame # " << imgnum << endl;
       }
-      if(cap.grab())
-         cap.retrieve(frame);
-      else
+      // the previous frame is not needed anymore
+      if(slot)
+         capture.release(slot);
+      slot = capture.pop();
+      if(slot == NULL)
       {
          cout << "Video is over\n";
          cv::waitKey(0);
          break;
       }
+      frame = slot->image;
       PlatesImage plates;
       //plateDetector.optimizeImage(frame, frame);
-      plateDetector.detectPlates(frame, &plates);
+      finished.clear();
+      frameCandidates(&plateDetector, motion ? &gate : NULL, frame, &slot->candidates, regions);
+      if(tracker)
+         tracker->match(&slot->candidates);
+      plateDetector.recognizeCandidates(&slot->candidates, &plates);
+      if(tracker)
+         tracker->update(slot->candidates, finished);
       if(debug_level) {
+         if(motion)
+            cout << "Changed regions: " << regions.size() << endl;
          cout << "Plates vector size: " << plates.plates.size() << endl;
+         cout << "Workspace buffer growth: " << plateDetector.frameBufferGrowth() << endl;
       }
       if(use_gui) {
-         cv::imshow("LiPRec", plates.image);
+         plates.render(frame, shown);
+         cv::imshow("LiPRec", shown);
       }  
-      if(plates.plates.size() > 0) {
-         for(unsigned int i=0;i<plates.plates.size();i++) {
-            cout << "** Plates found: " << plates.plates[i].platetxt;
-            cout << "   (confidence:" << plates.plates[i].confidence << ")"  << endl;
-         }
+      if(tracker ? printTracks(finished) : printPlates(plates, false)) {
          if(pause) {
             if(use_gui) {
                cv::waitKey();
@@ -158,6 +966,14 @@ int main(int argc, char* argv[])
          if(cv::waitKey(30) >= 0) break;
       }
    }
+   reportTracker(tracker);
+   delete tracker;
+   gate.report();
+   capture.report();
+   reportTiming(plateDetector.stageStats());
+   if(timing)
+      reportFilter(plateDetector);
+   reportCache(plateDetector);
    
    return 0;
 }
@@ -34,6 +34,50 @@
 #define LIPREC_PLATECON_AUTOTHRESHOLD        (2)
 #define LIPREC_PLATECON_CANNY                (3)
 
+#define LIPREC_RETAIN_TEXT                   (1)
+#define LIPREC_RETAIN_OCRIMAGE               (2)
+#define LIPREC_RETAIN_FULL                   (3)
+
+#define LIPREC_SEARCH_FULL                   (0)
+#define LIPREC_SEARCH_AUTO                   (-1)
+// widest image LIPREC_SEARCH_AUTO searches for candidates
+#define LIPREC_SEARCH_AUTO_WIDTH             (1280)
+
+#define LIPREC_STAGE_OPTIMIZE                (0)  // optimizeImage
+#define LIPREC_STAGE_EDGE                    (1)  // threshold, adaptive or Canny
+#define LIPREC_STAGE_CONTOURS                (2)  // findContours
+#define LIPREC_STAGE_FILTER                  (3)  // area, shape and polygon filter
+#define LIPREC_STAGE_CROP                    (4)  // mask, crop and resize
+#define LIPREC_STAGE_PLATE                   (5)  // plate thresholding
+#define LIPREC_STAGE_RECOGNIZE               (6)  // Tesseract Recognize
+#define LIPREC_STAGE_TEXT                    (7)  // Tesseract GetUTF8Text
+#define LIPREC_STAGES                        (8)
+#define LIPREC_STATS_BUCKETS                 (32)
+
+#define LIPREC_PLATE_ANY                     (0)  // any rectangle
+#define LIPREC_PLATE_EU                      (1)  // 520x110 mm
+#define LIPREC_PLATE_US                      (2)  // 12x6 in
+#define LIPREC_PLATE_AU                      (3)  // 372x134 mm
+
+#define LIPREC_OCR_TESSERACT                 (1)
+#define LIPREC_OCR_GLYPHS                    (2)  // built-in GlyphRecognizer
+
+#define LIPREC_OCR_INPUT_CROPS               (1)  // a masked, scaled image per candidate
+#define LIPREC_OCR_INPUT_FRAME               (2)  // rectangles of one band per frame
+
+// OCR images are hashed to LIPREC_CACHE_HASH_BITS bits for the OCR cache
+#define LIPREC_CACHE_HASH_BITS               (256)
+#define LIPREC_CACHE_ENTRIES                 (64)
+#define LIPREC_CACHE_DISTANCE                (12) // bits
+
+#define LIPREC_REJECT_LENGTH                 (0)  // too few points to reach the min area
+#define LIPREC_REJECT_BOX                    (1)  // bounding box under the min area
+#define LIPREC_REJECT_AREA                   (2)  // outside the area limits
+#define LIPREC_REJECT_ASPECT                 (3)  // rotated rect aspect out of the profile
+#define LIPREC_REJECT_FILL                   (4)  // rotated rect too empty
+#define LIPREC_REJECT_POLYGON                (5)  // not a convex quadrilateral
+#define LIPREC_REJECT_RULES                  (6)
+
 
 #ifdef __cplusplus
 
@@ -50,6 +94,11 @@
 namespace liprec
 {
 
+   struct Workspace;
+   class OCRPool;
+   struct PlateTrack;
+   class LiPRec;
+
 
    class Plate {
 
@@ -59,21 +108,214 @@ namespace liprec
          cv::Rect rect;
          cv::String platetxt;
          int confidence;
+         std::vector<int> confidences;   // per character, LIPREC_OCR_GLYPHS only
+         // draw the plate rectangle on a copy of img
+         void render(const cv::Mat &img, cv::Mat &out) const;
          //~Plate();
    }; 
    
    class PlatesImage {
    
       public:
+         PlatesImage() : frame(0) { }
+         long frame;
          cv::Mat image;
          cv::Mat optimizedimage;
          cv::Mat contours;
          std::vector<Plate> plates;
+         // draw all the plates rectangles on a copy of img
+         void render(const cv::Mat &img, cv::Mat &out) const;
          //~PlatesImage();
 
    };
 
 
+   // LIPREC_OPTIMIZATION_GREY_DEEP in one pass through memory: the grey
+   // conversion, the top/black hat contrast and the 5x5 gaussian are fused
+   // and run on row bands. With value it starts from the V channel instead,
+   // as LIPREC_OPTIMIZATION_HSV_DEEP does. Returns false without doing
+   // anything if inimg is not an 8 bit image with 3 or 4 channels.
+   bool fusedDeepOptimize(const cv::Mat &inimg, cv::Mat &outimg, bool value=false);
+
+   // The V channel of the HSV conversion, max(R,G,B), computed directly.
+   // Same input requirements as fusedDeepOptimize().
+   bool extractValue(const cv::Mat &inimg, cv::Mat &outimg);
+
+   // A possible plate, waiting for the OCR
+   class Candidate {
+
+      public:
+         Candidate() : confidence(0), skip(false), band(0) { }
+         cv::Rect rect;
+         cv::Mat ocrimage;        // OCR ready image, backed by store
+         cv::Mat store;
+         cv::String text;
+         int confidence;
+         std::vector<int> confidences;  // per character, LIPREC_OCR_GLYPHS only
+         bool skip;               // already read, text is not from the OCR
+         long band;               // not 0: ocrimage is a rectangle of the band
+                                  // of the frame, the same for all its candidates
+                                  // and never reused by another frame
+   };
+
+   // The plate candidates of a frame, from LiPRec::findCandidates to
+   // LiPRec::recognizeCandidates. Their buffers are reused with the object,
+   // so keep a few of them around instead of making one per frame.
+   class FrameCandidates {
+
+      public:
+         FrameCandidates() : frame(0), count(0) { std::fill(timing, timing+LIPREC_STAGES, 0.0); }
+         long frame;              // copied in PlatesImage::frame
+         std::vector<Candidate> candidates;  // only the first count are used
+         size_t count;
+         cv::Mat image;           // only with LIPREC_RETAIN_FULL
+         cv::Mat optimizedimage;  // only with LIPREC_RETAIN_FULL
+         double timing[LIPREC_STAGES];  // microseconds, only with timing enabled
+         cv::Mat bandstore;       // with LIPREC_OCR_INPUT_FRAME
+   };
+
+   // Time spent in every LIPREC_STAGE_* by the detections of a context, in
+   // microseconds. The OCR stages are summed over the OCR workers.
+   class StageStats {
+
+      public:
+         StageStats();
+         void reset();
+         void add(const double *timing);         // the stages of a frame
+         double mean(int stage) const;
+         // p in [0,1], read from the histogram so rounded up to a power of 2
+         double percentile(int stage, double p) const;
+         static const char *name(int stage);
+         unsigned long frames;
+         double last[LIPREC_STAGES];             // the last frame
+         double total[LIPREC_STAGES];
+         // frames where the stage took less than 1us in bucket 0,
+         // [2^(b-1), 2^b) us in bucket b
+         unsigned long histogram[LIPREC_STAGES][LIPREC_STATS_BUCKETS];
+   };
+
+   // The shape of the plates searched. Before the polygon approximation
+   // the contours are rejected if the rotated rectangle around them has
+   // an aspect ratio (long over short side) outside [min_aspect,
+   // max_aspect], or if they cover less than min_fill of it.
+   class PlateProfile {
+
+      public:
+         PlateProfile(double min_aspect=1, double max_aspect=12, double min_fill=0.45)
+            : min_aspect(min_aspect), max_aspect(max_aspect), min_fill(min_fill) { }
+         // one of LIPREC_PLATE_*, with room for perspective
+         static PlateProfile country(int country);
+         double min_aspect, max_aspect, min_fill;
+   };
+
+   // Plate reader for the 0-9 A-Z alphabet only, without Tesseract: the
+   // characters of a thresholded plate image are segmented and each one
+   // is given the symbol of the most correlated template. The templates
+   // come from the Hershey fonts and from what train() adds. It is not
+   // modified by recognize(), so many threads can share it.
+   class GlyphRecognizer {
+
+      public:
+         GlyphRecognizer();
+         // Add a sample of symbol: a dark glyph on a light background,
+         // cropped or not
+         void train(const cv::Mat &glyph, char symbol);
+         // The characters of plate from left to right, with the confidence
+         // 0-100 of every one of them in confidences if not NULL
+         cv::String recognize(const cv::Mat &plate, std::vector<int> *confidences=NULL) const;
+         int size() const;   // number of templates
+
+      private:
+         cv::Mat templates;           // a normalized glyph per row
+         std::vector<char> symbols;   // of every row
+         void add(const cv::Mat &mask, char symbol);
+         char classify(const cv::Mat &mask, int &confidence) const;
+   };
+
+   // The alternatives the OCR gives for a symbol, confidence 0-100
+   struct SymbolChoice {
+      char symbol;
+      float confidence;
+   };
+   typedef std::vector<SymbolChoice> SymbolChoices;
+
+   // Valid plate formats compiled into an automaton over letters and
+   // digits. patterns are separated by '|', with L a letter, N a digit, A
+   // either, anything else ignored: "NNNLLL|LLNNNLL". Empty accepts all.
+   class PlateFormat {
+
+      public:
+         PlateFormat(const std::string &patterns="");
+         bool empty() const;
+         bool matches(const std::string &text) const;
+         // The valid string with the highest total confidence over the
+         // choices of every symbol, where a choice can also be read as its
+         // look-alike (0/O, 1/I, 8/B...) and an extra symbol can be left
+         // out. False if no format fits. confidence is the mean of the
+         // symbols kept.
+         bool decode(const std::vector<SymbolChoices> &symbols, std::string &text,
+                     int &confidence) const;
+
+      private:
+         std::vector<int> table;        // state x symbol class, -1 none
+         std::vector<bool> accepting;   // by state, 0 is the start
+         int state();
+         void add(const std::string &pattern, size_t pos, int from);
+   };
+
+   // Crop the candidate contour idx out of the optimized image into an
+   // image ready for the OCR. Works only inside the candidate bounding box,
+   // that is returned, and never modifies optimizedimage.
+   cv::Rect cropCandidate(const cv::Mat &optimizedimage,
+                          const std::vector< std::vector<cv::Point> > &contours,
+                          int idx, cv::Mat &ocrimg);
+
+
+   // The mutable state of a detection: scratch buffers, candidates and
+   // OCR engines. A configured LiPRec can serve many threads at the same
+   // time, each one calling it with its own context, without any lock.
+   // Every engine loads its own Tesseract model, on the first plate it
+   // reads: a context that never recognizes anything costs no model.
+   class DetectContext {
+
+      public:
+         DetectContext(const LiPRec &detector, int ocr_workers=1);
+         virtual ~DetectContext();
+         // Times the workspace buffers, contour points included, grew in
+         // the last detection with this context and since its creation.
+         // Only those: the scratch OpenCV allocates inside its functions
+         // (filter engines, contour scanner...), the candidate text and
+         // the plates are not counted.
+         unsigned long frameBufferGrowth() const;
+         unsigned long totalBufferGrowth() const;
+         // Time the stages of the detections with this context. Disabled,
+         // the default, no clock is read at all.
+         void setTiming(bool enable=true);
+         const StageStats *stageStats() const;  // NULL if not enabled
+         // Contours looked at by the candidate search since the creation,
+         // and how many of them each LIPREC_REJECT_* rule threw away
+         unsigned long contoursSeen() const;
+         unsigned long contoursRejected(int rule) const;
+         static const char *rejectName(int rule);
+         // Remember the last entries OCR results by a perceptual hash of
+         // the image read: a later image whose hash differs by at most
+         // max_distance bits, of about the same size, gets the same text
+         // and confidence without running the OCR. 0 entries disables it.
+         void setOCRCache(int entries=LIPREC_CACHE_ENTRIES,
+                          int max_distance=LIPREC_CACHE_DISTANCE);
+         unsigned long ocrCacheHits() const;
+         unsigned long ocrCacheMisses() const;
+
+      private:
+         friend class LiPRec;
+         Workspace *ws;
+         OCRPool *ocr;
+         FrameCandidates candidates;
+         DetectContext(const DetectContext &);             // not copyable
+         DetectContext &operator=(const DetectContext &);
+   };
+
+
    class LiPRec {
 
       public:
@@ -85,30 +327,180 @@ namespace liprec
                 int min_ocr_confidence=33
                 );
  
+         // These use the context of the LiPRec object itself, so only
+         // one thread at a time can call them.
          void optimizeImage(const cv::Mat &inimg, cv::Mat &outimg);
-         void detectPlates(cv::Mat &img,  PlatesImage* plates,
+         void detectPlates(const cv::Mat &img,  PlatesImage* plates,
                            int min_area=600, int max_area=6000);
-         void detectPlates(cv::Mat &img, cv::Mat &optimizedimage, PlatesImage* plates,
+         void detectPlates(const cv::Mat &img, const cv::Mat &optimizedimage, PlatesImage* plates,
                            int min_area=600, int max_area=6000);
+         // Reentrant versions, all the mutable state is in ctx. The
+         // configuration must not change while they are running.
+         void optimizeImage(const cv::Mat &inimg, cv::Mat &outimg, DetectContext &ctx) const;
+         // The top hat/black hat contrast step of the DEEP optimizations
+         // alone, in place on an 8 bit single channel image
+         void maximizeContrast(cv::Mat &img, DetectContext &ctx) const;
+         void detectPlates(const cv::Mat &img, PlatesImage* plates, DetectContext &ctx,
+                           int min_area=600, int max_area=6000) const;
+         void detectPlates(const cv::Mat &img, const cv::Mat &optimizedimage, PlatesImage* plates,
+                           DetectContext &ctx, int min_area=600, int max_area=6000) const;
+         // What detectPlates keeps in the results:
+         //   LIPREC_RETAIN_TEXT      only plate text, confidence and rect
+         //   LIPREC_RETAIN_OCRIMAGE  plus the image given to the OCR
+         //   LIPREC_RETAIN_FULL      plus the frame sized images (debug)
+         void setRetention(int level=LIPREC_RETAIN_TEXT);
+         // Times the workspace buffers grew in the last detectPlates call
+         // and since the creation, as DetectContext::frameBufferGrowth.
+         // After the first frames of a given size the former should stay
+         // at zero; it is not a count of the heap allocations.
+         unsigned long frameBufferGrowth() const;
+         unsigned long totalBufferGrowth() const;
+         // Same as DetectContext::setTiming and stageStats, for the
+         // detections with the LiPRec own context
+         void setTiming(bool enable=true);
+         const StageStats *stageStats() const;
+         unsigned long contoursSeen() const;
+         unsigned long contoursRejected(int rule) const;
+         // Same as DetectContext::setOCRCache, for the LiPRec own context,
+         // the batch ones and the contexts created after the call
+         void setOCRCache(int entries=LIPREC_CACHE_ENTRIES,
+                          int max_distance=LIPREC_CACHE_DISTANCE);
+         unsigned long ocrCacheHits() const;
+         unsigned long ocrCacheMisses() const;
+         // Detect the plates of many images spreading them over threads (0
+         // means one per CPU), each with its own buffers and OCR engine,
+         // kept for the next calls. results[i] are the plates of images[i]
+         // and have frame set to i.
+         void detectPlatesBatch(const std::vector<cv::Mat> &images,
+                                std::vector<PlatesImage> &results,
+                                int min_area=600, int max_area=6000, int threads=0);
+         // The two stages of detectPlates, to run them in different
+         // threads: with the same context one thread can be in
+         // findCandidates while another one is in recognizeCandidates.
+         void findCandidates(const cv::Mat &img, FrameCandidates *candidates,
+                             int min_area=600, int max_area=6000);
+         void recognizeCandidates(FrameCandidates *candidates, PlatesImage* plates);
+         void findCandidates(const cv::Mat &img, FrameCandidates *candidates,
+                             DetectContext &ctx, int min_area=600, int max_area=6000) const;
+         void recognizeCandidates(FrameCandidates *candidates, PlatesImage* plates,
+                                  DetectContext &ctx) const;
+         void findCandidates(const cv::Mat &img, const cv::Mat &optimizedimage,
+                             FrameCandidates *candidates, DetectContext &ctx,
+                             int min_area=600, int max_area=6000) const;
          void setThreshold(int min=128, int max=255);
          void setAutothreshold(int size=21);
          void setPlateThreshold(int min, int max=255);
          void setPlateAutothreshold(int size=11);
          void setPerimeterConstant(int val=35);
+         // Shape of the plates, LIPREC_PLATE_ANY by default
+         void setPlateProfile(int country=LIPREC_PLATE_ANY);
+         void setPlateProfile(const PlateProfile &shape);
+         // Number of Tesseract engines recognizing the candidates of a
+         // frame in parallel, each one but the first has its own thread.
+         // Only for the LiPRec own context, see DetectContext otherwise.
+         void setOCRWorkers(int workers=1);
+         // Who reads the candidates, LIPREC_OCR_TESSERACT or
+         // LIPREC_OCR_GLYPHS. The glyph recognizer is shared by all the
+         // contexts created after the call; train it before detecting.
+         void setRecognizer(int engine=LIPREC_OCR_TESSERACT);
+         // What the OCR gets: with LIPREC_OCR_INPUT_CROPS, the default,
+         // every candidate is masked, scaled up and binarized on its own.
+         // With LIPREC_OCR_INPUT_FRAME the rows of the frame holding the
+         // candidates are binarized once, at frame resolution, and each
+         // OCR engine is given that band once and reads every candidate
+         // as a rectangle of it: no per candidate copy or conversion.
+         void setOCRInput(int input=LIPREC_OCR_INPUT_CROPS);
+         // Accept only the plates of format (see PlateFormat): the OCR
+         // choices of every symbol are decoded to the best valid string and
+         // the candidates that fit no pattern are dropped. "" accepts all.
+         void setPlateFormat(const std::string &patterns);
+         GlyphRecognizer *glyphRecognizer();
+         // Search the candidates on the optimized image halved level times,
+         // the areas limits are scaled to match, while the OCR still gets
+         // the crop at full resolution. LIPREC_SEARCH_AUTO halves it until
+         // it is not wider than LIPREC_SEARCH_AUTO_WIDTH.
+         void setSearchLevel(int level=LIPREC_SEARCH_FULL);
          virtual ~LiPRec();                // descructor
 
       private:
-         int opt, cont, pcont, min_confidence;
+         int opt, cont, pcont, min_confidence, retention, search_level, recognizer;
+         int cache_entries, cache_distance, ocr_input;
+         GlyphRecognizer *glyphs;   // NULL until LIPREC_OCR_GLYPHS is chosen
+         PlateFormat format;
          int thr_min, thr_max, athr_size;
          int thrp_min, thrp_max, athrp_size;
          float perimeter_constant;
-         tesseract::TessBaseAPI *OCR;
+         PlateProfile profile;
+         friend class DetectContext;
+         friend class PlateTracker;
+         DetectContext *context;
          tesseract::PageSegMode ocr_ptype;
-         void startOCR(tesseract::PageSegMode pagetype);
-         void maximizeContrast(cv::Mat &img);
-         void extractV(const cv::Mat &inimg, cv::Mat &outimg);
-         void _detectPlates(cv::Mat &img, cv::Mat &optimizedimage, PlatesImage* plates,
-                           int min_area=600, int max_area=6000);
+         std::vector<DetectContext*> batch;
+         void startOCR(tesseract::PageSegMode pagetype, int workers);
+         void maximizeContrast(cv::Mat &img, Workspace *w) const;
+         void extractV(const cv::Mat &inimg, cv::Mat &outimg, Workspace *w) const;
+         void _optimizeImage(const cv::Mat &inimg, cv::Mat &outimg, Workspace *w) const;
+         void _findCandidates(const cv::Mat &img, FrameCandidates *candidates,
+                              int min_area, int max_area, Workspace *w) const;
+         void _findCandidates(const cv::Mat &img, const cv::Mat &optimizedimage,
+                              FrameCandidates *candidates, int min_area, int max_area,
+                              Workspace *w) const;
+         void _recognizeCandidates(FrameCandidates *candidates, PlatesImage* plates,
+                                   OCRPool *pool, StageStats *stats) const;
+         void binarizePlate(const cv::Mat &img, cv::Mat &out) const;
+         void _bandCandidates(const cv::Mat &optimizedimage, FrameCandidates *candidates,
+                              Workspace *w, double *timing) const;
+   };
+
+
+   // A plate followed across frames, with the reads of the OCR voted
+   class TrackedPlate {
+
+      public:
+         TrackedPlate() : id(0), first(0), last(0), votes(0), reads(0), confidence(0) { }
+         long id;
+         long first, last;        // FrameCandidates::frame it was seen first and last
+         cv::Rect rect;           // where it was seen last
+         cv::String platetxt;     // the most voted read
+         int votes, reads;        // reads of platetxt, of all the valid ones
+         int confidence;          // best confidence of platetxt
+   };
+
+   // Follows the candidates across frames by the overlap of their boxes,
+   // after moving the tracked box by its last motion. Once a track has a
+   // read with at least confident confidence the OCR is not run on it
+   // again: its candidates get the voted text instead. Per frame:
+   //    detector.findCandidates(img, &candidates);
+   //    tracker.match(&candidates);
+   //    detector.recognizeCandidates(&candidates, &plates);
+   //    tracker.update(candidates, finished);
+   class PlateTracker {
+
+      public:
+         PlateTracker(const LiPRec &detector, int confident=75, double min_overlap=0.3,
+                      int max_missed=5);
+         virtual ~PlateTracker();
+         void match(FrameCandidates *candidates);
+         // Vote the reads of the frame. The tracks not seen for more than
+         // max_missed frames are closed and, if they had any valid read,
+         // appended to finished.
+         void update(const FrameCandidates &candidates, std::vector<TrackedPlate> &finished);
+         // Close all the tracks, at the end of the video
+         void flush(std::vector<TrackedPlate> &finished);
+         // Candidates matched that went to the OCR and that skipped it
+         unsigned long ocrRuns() const;
+         unsigned long ocrSkipped() const;
+
+      private:
+         int min_confidence, confident, max_missed;
+         double min_overlap;
+         long next_id;
+         unsigned long runs, skipped;
+         std::vector<PlateTrack*> tracks;
+         std::vector<int> assigned;   // track of each candidate, -1 for a new one
+         void close(size_t t, std::vector<TrackedPlate> &finished);
+         PlateTracker(const PlateTracker &);               // not copyable
+         PlateTracker &operator=(const PlateTracker &);
    };
 
 
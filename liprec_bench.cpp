@@ -0,0 +1,1012 @@
+/***********************************************************************
+    This file is part of LiPRec, License Plate REcognition.
+
+    Copyright (C) 2012 Franco (nextime) Lanza <nextime@nexlab.it>
+
+    LiPRec is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LiPRec is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with LiPRec.  If not, see <http://www.gnu.org/licenses/>.
+************************************************************************/
+#include "liprec.h"
+#include "opencv2/opencv.hpp"
+#include "optionparser.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <map>
+
+using namespace liprec;
+using namespace std;
+using namespace cv;
+
+enum  optionIndex { OPT_UNKNOWN, OPT_HELP, OPT_ITERATIONS, OPT_CANDIDATES, OPT_WORKERS,
+                    OPT_OUTPUT, OPT_BASELINE, OPT_TOLERANCE, OPT_TRUTH };
+const option::Descriptor usage[] =
+ {
+  {OPT_UNKNOWN, 0,"", ""    ,option::Arg::None, "USAGE: liprec_bench [options] <benchmark> [image_file...]\n\n"
+                                                 "Without image files synthetic 720p, 1080p and 4K frames are used.\n\n"
+                                                 "Benchmarks:\n"
+                                                 "  crop  \tper candidate crop cost, full frame vs bounding box\n"
+                                                 "  ocr  \tdetection throughput with 1 to N OCR workers\n"
+                                                 "  batch  \tdetectPlatesBatch throughput with 1 to N threads\n"
+                                                 "  deep  \tfused GREY_DEEP kernel vs the OpenCV chain\n"
+                                                 "  value  \tdirect V extraction vs cvtColor HSV + mixChannels\n"
+                                                 "  search  \tcandidate search on pyramid levels vs full resolution\n"
+                                                 "  modes  \tthroughput, latency and OCR share of every mode combination\n"
+                                                 "  stages  \teach preprocessing and candidate kernel alone, without OCR\n"
+                                                 "  glyphs  \tbuilt-in glyph recognizer vs Tesseract, speed and accuracy\n"
+                                                 "  input  \tOCR input, one image per candidate vs one band per frame\n\n"
+                                                 "Options:" },
+  {OPT_HELP,    0,"h","help",option::Arg::None, "  -h, --help  \tPrint usage and exit." },
+  {OPT_ITERATIONS, 0,"n","iterations",option::Arg::Optional, "  -n<num>, --iterations=<num>  \tRepeat every measure num times (default 20)."},
+  {OPT_CANDIDATES, 0,"c","candidates",option::Arg::Optional, "  -c<num>, --candidates=<num>  \tPlates drawn on synthetic frames (default 12)."},
+  {OPT_WORKERS, 0,"w","workers",option::Arg::Optional, "  -w<num>, --workers=<num>  \tMaximum number of workers (default number of CPUs)."},
+  {OPT_OUTPUT, 0,"o","output",option::Arg::Optional, "  -o<file>, --output=<file>  \tmodes: write the results as CSV."},
+  {OPT_BASELINE, 0,"b","baseline",option::Arg::Optional, "  -b<file>, --baseline=<file>  \tmodes: compare with the CSV of a previous run, fail on regressions."},
+  {OPT_TOLERANCE, 0,"t","tolerance",option::Arg::Optional, "  -t<pct>, --tolerance=<pct>  \tmodes: slowdown accepted before a regression (default 10)."},
+  {OPT_TRUTH, 0,"g","groundtruth",option::Arg::Optional, "  -g<file>, --groundtruth=<file>  \tmodes, glyphs and input: also measure accuracy against the plates in file."
+                                                 " Without image files the images of the manifest are used."},
+  {OPT_UNKNOWN, 0,"", ""   ,option::Arg::None, "\nExamples:\n"
+                                                 "  liprec_bench crop\n"
+                                                 "  liprec_bench -n100 crop testdata/680mnp_big.jpg\n"
+                                                 "  liprec_bench -w8 ocr testdata/7804347_DNjJkq.jpeg\n"
+                                                 "  liprec_bench -n10 batch testdata/7804*.jpeg\n"
+                                                 "  liprec_bench -n3 -o bench.csv -b bench_baseline.csv modes testdata/*.jpg\n"
+                                                 "  liprec_bench -n1 -gtestdata/groundtruth.txt modes\n"
+                                                 "  liprec_bench -n50 stages testdata/777xvx.JPG\n"
+                                                 "  liprec_bench -n5 -gtestdata/groundtruth.txt glyphs\n"
+                                                 "  liprec_bench -n5 -c40 input\n" },
+  {0,0,0,0,0,0}
+ };
+
+
+// Detected plates overlapping an expected one by less than this are misses
+#define GROUNDTRUTH_MIN_OVERLAP 0.3
+
+
+struct PlateTruth {
+   Rect rect;
+   string text;
+};
+
+// Expected plates by image file name, without the directory
+struct GroundTruth {
+   vector<string> images;
+   map<string, vector<PlateTruth> > plates;
+};
+
+struct BenchFrame {
+   BenchFrame() : labelled(false) { }
+   cv::String name;
+   Mat image;
+   bool labelled;
+   vector<PlateTruth> truth;
+};
+
+
+static double ticksToUs(int64 ticks)
+{
+   return ticks * 1000000.0 / getTickFrequency();
+}
+
+
+// Grey noisy background with some dark bordered white rectangles with
+// text in them, enough to look like plates to the contour search.
+static Mat syntheticFrame(Size size, int plates, RNG &rng)
+{
+   Mat frame(size, CV_8UC3);
+   randu(frame, Scalar::all(60), Scalar::all(120));
+   for(int i=0;i<plates;i++) {
+      Rect r(rng.uniform(0, size.width-120), rng.uniform(0, size.height-40), 110, 32);
+      rectangle(frame, r, Scalar(250,250,250), CV_FILLED);
+      rectangle(frame, r, Scalar(10,10,10), 2);
+      putText(frame, "AB 123", Point(r.x+8, r.y+24), FONT_HERSHEY_SIMPLEX, 0.7,
+              Scalar(0,0,0), 2);
+   }
+   return frame;
+}
+
+
+static string baseName(const string &path)
+{
+   size_t slash = path.find_last_of('/');
+   return slash == string::npos ? path : path.substr(slash+1);
+}
+
+
+// Manifest lines are "<image> <x> <y> <width> <height> <text>", or
+// "<image> -" for an image without plates. Images are relative to the
+// directory of the manifest.
+static bool loadGroundTruth(const char *file, GroundTruth &truth)
+{
+   ifstream in(file);
+   if(!in)
+      return false;
+   string dir = file;
+   size_t slash = dir.find_last_of('/');
+   dir = slash == string::npos ? "" : dir.substr(0, slash+1);
+
+   string line;
+   while(getline(in, line)) {
+      if(line.empty() || line[0] == '#')
+         continue;
+      stringstream fields(line);
+      string image;
+      fields >> image;
+      if(image.empty())
+         continue;
+      if(!truth.plates.count(image))
+         truth.images.push_back(dir + image);
+      vector<PlateTruth> &plates = truth.plates[image];
+      PlateTruth plate;
+      if(!(fields >> plate.rect.x >> plate.rect.y >> plate.rect.width >> plate.rect.height))
+         continue;
+      getline(fields >> ws, plate.text);
+      plates.push_back(plate);
+   }
+   return true;
+}
+
+
+static void loadFrames(option::Parser &parse, int plates, const GroundTruth *truth,
+                       vector<BenchFrame> &frames)
+{
+   vector<string> files;
+   for(int i=1;i<parse.nonOptionsCount();i++)
+      files.push_back(parse.nonOption(i));
+   if(files.empty() && truth)
+      files = truth->images;
+
+   for(unsigned int i=0;i<files.size();i++) {
+      BenchFrame f;
+      f.name = files[i];
+      f.image = imread(f.name);
+      if(f.image.empty()) {
+         cout << "Cannot open file " << f.name << endl;
+         continue;
+      }
+      if(truth) {
+         map<string, vector<PlateTruth> >::const_iterator t = truth->plates.find(baseName(files[i]));
+         if(t != truth->plates.end()) {
+            f.labelled = true;
+            f.truth = t->second;
+         }
+      }
+      frames.push_back(f);
+   }
+   if(!files.empty())
+      return;
+
+   const Size sizes[] = { Size(1280,720), Size(1920,1080), Size(3840,2160) };
+   const char *names[] = { "synthetic-720p", "synthetic-1080p", "synthetic-4K" };
+   RNG rng(0x11b7ec);
+   for(int i=0;i<3;i++) {
+      BenchFrame f;
+      f.name = names[i];
+      f.image = syntheticFrame(sizes[i], plates, rng);
+      frames.push_back(f);
+   }
+}
+
+
+// Same candidate search of LiPRec with the default settings
+static void findCandidates(const Mat &optimized, vector< vector<Point> > &contours,
+                           vector<int> &candidates, int min_area=600, int max_area=6000)
+{
+   Mat edge;
+   Canny(optimized, edge, 128, 255);
+   findContours(edge, contours, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_NONE);
+   candidates.clear();
+   for(unsigned int i=0;i<contours.size();i++) {
+      double area = std::fabs(contourArea(Mat(contours[i])));
+      if(area < min_area || area > max_area)
+         continue;
+      vector<Point> results;
+      approxPolyDP(Mat(contours[i]), results, arcLength(Mat(contours[i]),1)*35/1000.0, 1);
+      if(results.size() == 4 && isContourConvex(results))
+         candidates.push_back(i);
+   }
+}
+
+
+// The candidate crop as it was done before cropCandidate(): full frame
+// mask and crop, contour drawn on the whole optimized image and restore.
+static void legacyCrop(Mat &optimized, const Mat &saved,
+                       const vector< vector<Point> > &contours, int i, Mat &ocrimg)
+{
+   Mat mask = Mat::zeros(optimized.rows, optimized.cols, CV_8UC1);
+   drawContours(mask, contours, i, Scalar(255,255,255), CV_FILLED);
+   drawContours(optimized, contours, i, Scalar(255,255,255), 2, 2);
+   Rect box = boundingRect(Mat(contours[i]));
+   Mat crop(optimized.rows, optimized.cols, CV_8UC1);
+   crop.setTo(Scalar(0));
+   optimized.copyTo(crop, mask);
+   saved.copyTo(optimized);
+   Mat roi(crop, box);
+   ocrimg.create(roi.rows, roi.cols, CV_8UC1);
+   ocrimg.setTo(Scalar(255));
+   roi.copyTo(ocrimg, roi);
+}
+
+
+static int benchCrop(const vector<BenchFrame> &frames, int iterations)
+{
+   LiPRec detector;
+
+   printf("%-24s %11s %10s %14s %12s %8s %s\n", "frame", "size", "candidates",
+          "fullframe(us)", "bbox(us)", "speedup", "output");
+   for(unsigned int f=0;f<frames.size();f++) {
+      Mat optimized, saved;
+      vector< vector<Point> > contours;
+      vector<int> candidates;
+      detector.optimizeImage(frames[f].image, optimized);
+      optimized.copyTo(saved);
+      findCandidates(optimized, contours, candidates);
+
+      int64 legacy=0, roi=0;
+      bool same=true;
+      Mat a, b;
+      for(int n=0;n<iterations;n++) {
+         for(unsigned int c=0;c<candidates.size();c++) {
+            int64 t0 = getTickCount();
+            legacyCrop(optimized, saved, contours, candidates[c], a);
+            int64 t1 = getTickCount();
+            cropCandidate(optimized, contours, candidates[c], b);
+            int64 t2 = getTickCount();
+            legacy += t1-t0;
+            roi += t2-t1;
+            if(n == 0 && norm(a, b, NORM_INF) != 0)
+               same=false;
+         }
+      }
+
+      double runs = (double)iterations*std::max<size_t>(candidates.size(), 1);
+      char size[32];
+      snprintf(size, sizeof(size), "%dx%d", frames[f].image.cols, frames[f].image.rows);
+      printf("%-24s %11s %10d %14.1f %12.1f %7.1fx %s\n", frames[f].name.c_str(), size,
+             (int)candidates.size(), ticksToUs(legacy)/runs, ticksToUs(roi)/runs,
+             roi > 0 ? (double)legacy/roi : 0.0, same ? "identical" : "DIFFERENT");
+   }
+   return 0;
+}
+
+
+static bool samePlates(const PlatesImage &a, const PlatesImage &b)
+{
+   if(a.plates.size() != b.plates.size())
+      return false;
+   for(unsigned int i=0;i<a.plates.size();i++) {
+      if(a.plates[i].platetxt != b.plates[i].platetxt || a.plates[i].rect != b.plates[i].rect)
+         return false;
+   }
+   return true;
+}
+
+
+static int benchOCR(const vector<BenchFrame> &frames, int iterations, int workers)
+{
+   vector<PlatesImage> reference(frames.size());
+   double base=0;
+
+   printf("%-8s %10s %12s %8s %7s %s\n", "workers", "frames/s", "ms/frame", "speedup",
+          "plates", "results");
+   for(int w=1;w<=workers;w++) {
+      LiPRec detector;
+      detector.setOCRWorkers(w);
+
+      vector<PlatesImage> results(frames.size());
+      int64 total=0;
+      for(int n=0;n<iterations;n++) {
+         for(unsigned int f=0;f<frames.size();f++) {
+            PlatesImage plates;
+            Mat img = frames[f].image;
+            int64 t0 = getTickCount();
+            detector.detectPlates(img, &plates);
+            total += getTickCount()-t0;
+            if(n == 0)
+               results[f] = plates;
+         }
+      }
+
+      bool same=true;
+      size_t found=0;
+      for(unsigned int f=0;f<frames.size();f++) {
+         if(w == 1)
+            reference[f] = results[f];
+         same = same && samePlates(reference[f], results[f]);
+         found += results[f].plates.size();
+      }
+      double runs = (double)iterations*frames.size();
+      double msframe = ticksToUs(total)/1000.0/runs;
+      if(w == 1)
+         base = msframe;
+      printf("%-8d %10.2f %12.2f %7.2fx %7d %s\n", w, 1000.0/msframe, msframe,
+             base/msframe, (int)found, same ? "deterministic" : "DIFFERENT");
+   }
+   return 0;
+}
+
+
+// LIPREC_OPTIMIZATION_GREY_DEEP as it was done before fusedDeepOptimize(),
+// with the temporaries allocated by the caller
+static void deepChain(const Mat &img, Mat &out, Mat &th, Mat &bh, Mat &s1, const Mat &el)
+{
+   cvtColor(img, out, CV_RGB2GRAY);
+   morphologyEx(out, th, MORPH_TOPHAT, el, Point(1,1), 1);
+   morphologyEx(out, bh, MORPH_BLACKHAT, el, Point(1,1), 1);
+   add(out, th, s1);
+   subtract(s1, bh, out);
+   GaussianBlur(out, out, Size(5,5), 5, 5, BORDER_DEFAULT);
+}
+
+
+static int benchDeep(const vector<BenchFrame> &frames, int iterations)
+{
+   Mat el = getStructuringElement(MORPH_ELLIPSE, Size(3,3), Point(1,1));
+
+   printf("%-24s %11s %10s %10s %8s %8s %s\n", "frame", "size", "chain(ms)", "fused(ms)",
+          "speedup", "maxdiff", "differing");
+   for(unsigned int f=0;f<frames.size();f++) {
+      Mat a, b, th, bh, s1;
+      deepChain(frames[f].image, a, th, bh, s1, el);
+      fusedDeepOptimize(frames[f].image, b);
+
+      int64 chain=0, fused=0;
+      for(int n=0;n<iterations;n++) {
+         int64 t0 = getTickCount();
+         deepChain(frames[f].image, a, th, bh, s1, el);
+         int64 t1 = getTickCount();
+         fusedDeepOptimize(frames[f].image, b);
+         int64 t2 = getTickCount();
+         chain += t1-t0;
+         fused += t2-t1;
+      }
+
+      Mat diff;
+      absdiff(a, b, diff);
+      double maxdiff;
+      minMaxLoc(diff, NULL, &maxdiff);
+      char size[32];
+      snprintf(size, sizeof(size), "%dx%d", frames[f].image.cols, frames[f].image.rows);
+      printf("%-24s %11s %10.2f %10.2f %7.2fx %8d %8.4f%%\n", frames[f].name.c_str(), size,
+             ticksToUs(chain)/1000.0/iterations, ticksToUs(fused)/1000.0/iterations,
+             fused > 0 ? (double)chain/fused : 0.0, (int)maxdiff,
+             100.0*countNonZero(diff)/diff.total());
+   }
+   return 0;
+}
+
+
+static int benchValue(const vector<BenchFrame> &frames, int iterations)
+{
+   int from_to[] = { 2,0 };
+
+   printf("%-24s %11s %10s %10s %8s %s\n", "frame", "size", "hsv(ms)", "direct(ms)",
+          "speedup", "identical");
+   int ret = 0;
+   for(unsigned int f=0;f<frames.size();f++) {
+      Mat hsv, a, b;
+      a.create(frames[f].image.size(), CV_8UC1);
+
+      int64 old=0, direct=0;
+      for(int n=0;n<iterations;n++) {
+         int64 t0 = getTickCount();
+         cvtColor(frames[f].image, hsv, CV_RGB2HSV);
+         mixChannels(&hsv, 1, &a, 1, from_to, 1);
+         int64 t1 = getTickCount();
+         extractValue(frames[f].image, b);
+         int64 t2 = getTickCount();
+         old += t1-t0;
+         direct += t2-t1;
+      }
+
+      bool same = norm(a, b, NORM_INF) == 0;
+      if(!same)
+         ret = 1;
+      char size[32];
+      snprintf(size, sizeof(size), "%dx%d", frames[f].image.cols, frames[f].image.rows);
+      printf("%-24s %11s %10.2f %10.2f %7.2fx %s\n", frames[f].name.c_str(), size,
+             ticksToUs(old)/1000.0/iterations, ticksToUs(direct)/1000.0/iterations,
+             direct > 0 ? (double)old/direct : 0.0, same ? "yes" : "NO");
+   }
+   return ret;
+}
+
+
+struct ModeResult {
+   double rate, p50, p95, p99, ocr;   // images/s, ms, ms, ms, share of time
+   double recall, precision, exact, chars;   // -1 without ground truth
+};
+
+
+// Plates found on the labelled frames, matched one to one with the expected ones
+struct Accuracy {
+   Accuracy() : expected(0), detected(0), matched(0), exact(0), chars(0) { }
+   int expected, detected, matched, exact;
+   double chars;   // sum of the character accuracy of every expected plate
+};
+
+// Letters and digits only, upper case: spacing and separators do not count
+static string plateText(const string &text)
+{
+   string out;
+   for(unsigned int i=0;i<text.size();i++)
+      if(isalnum((unsigned char)text[i]))
+         out += (char)toupper((unsigned char)text[i]);
+   return out;
+}
+
+static int editDistance(const string &a, const string &b)
+{
+   vector<int> row(b.size()+1);
+   for(unsigned int j=0;j<=b.size();j++)
+      row[j] = j;
+   for(unsigned int i=1;i<=a.size();i++) {
+      int diagonal = row[0];
+      row[0] = i;
+      for(unsigned int j=1;j<=b.size();j++) {
+         int up = row[j];
+         row[j] = std::min(std::min(row[j]+1, row[j-1]+1), diagonal + (a[i-1] != b[j-1]));
+         diagonal = up;
+      }
+   }
+   return row[b.size()];
+}
+
+static double overlap(const Rect &a, const Rect &b)
+{
+   double inter = (a & b).area();
+   double uni = a.area() + b.area() - inter;
+   return uni > 0 ? inter/uni : 0;
+}
+
+// Every expected plate takes the free detected plate overlapping it most.
+// Text and characters count only on matched plates.
+static void scorePlates(const vector<PlateTruth> &truth, const vector<Plate> &plates, Accuracy &acc)
+{
+   vector<bool> used(plates.size(), false);
+   acc.expected += truth.size();
+   acc.detected += plates.size();
+   for(unsigned int t=0;t<truth.size();t++) {
+      int best = -1;
+      double best_overlap = GROUNDTRUTH_MIN_OVERLAP;
+      for(unsigned int p=0;p<plates.size();p++) {
+         double o = overlap(truth[t].rect, plates[p].rect);
+         if(!used[p] && o >= best_overlap) {
+            best = p;
+            best_overlap = o;
+         }
+      }
+      if(best < 0)
+         continue;
+      used[best] = true;
+      acc.matched++;
+      string expected = plateText(truth[t].text);
+      string read = plateText(plates[best].platetxt);
+      if(read == expected)
+         acc.exact++;
+      if(!expected.empty())
+         acc.chars += std::max(0.0, 1.0 - (double)editDistance(expected, read)/expected.size());
+   }
+}
+
+static const char *optimizationNames[] = { "grey_basic", "hsv_basic", "grey_deep", "hsv_deep" };
+static const char *contourNames[] = { "threshold", "autothreshold", "canny" };
+
+static double percentile(const vector<double> &sorted, double p)
+{
+   if(sorted.empty())
+      return 0;
+   size_t i = (size_t)(p*(sorted.size()-1) + 0.5);
+   return sorted[std::min(i, sorted.size()-1)];
+}
+
+// Results of a previous run, by "optimization,contour,platecont"
+static bool loadBaseline(const char *file, map<string, ModeResult> &baseline)
+{
+   ifstream in(file);
+   if(!in)
+      return false;
+   string line;
+   getline(in, line);   // header
+   while(getline(in, line)) {
+      stringstream fields(line);
+      string o, c, p, value;
+      if(!getline(fields, o, ',') || !getline(fields, c, ',') || !getline(fields, p, ','))
+         continue;
+      ModeResult r;
+      double *values[] = { &r.rate, &r.p50, &r.p95, &r.p99, &r.ocr,
+                           &r.recall, &r.precision, &r.exact, &r.chars };
+      for(int v=0;v<9;v++)
+         *values[v] = getline(fields, value, ',') && !value.empty() ? atof(value.c_str()) : -1;
+      baseline[o+","+c+","+p] = r;
+   }
+   return true;
+}
+
+// Every combination of optimization, contour and plate contour on all the
+// frames. Latency is the detectPlates time of a single image. Labelled
+// frames are scored on the plates of the first iteration.
+static int benchModes(const vector<BenchFrame> &frames, int iterations, const char *output,
+                      const char *baseline_file, double tolerance)
+{
+   map<string, ModeResult> baseline;
+   if(baseline_file && !loadBaseline(baseline_file, baseline))
+      printf("No baseline in %s, nothing to compare with\n", baseline_file);
+   FILE *csv = NULL;
+   if(output) {
+      csv = fopen(output, "w");
+      if(csv == NULL) {
+         printf("Cannot write %s\n", output);
+         return -1;
+      }
+      fprintf(csv, "optimization,contour,platecont,images_per_s,p50_ms,p95_ms,p99_ms,ocr_share,"
+                   "recall,precision,exact_match,char_accuracy\n");
+   }
+   bool labelled = false;
+   for(unsigned int f=0;f<frames.size();f++)
+      labelled |= frames[f].labelled;
+
+   printf("%-11s %-14s %-14s %10s %8s %8s %8s %6s", "optimize", "contour", "platecont",
+          "images/s", "p50(ms)", "p95(ms)", "p99(ms)", "ocr");
+   if(labelled)
+      printf(" %6s %6s %6s %6s", "recall", "prec", "exact", "chars");
+   printf(" %s\n", "baseline");
+   int regressions = 0;
+   for(int o=LIPREC_OPTIMIZATION_GREY_BASIC;o<=LIPREC_OPTIMIZATION_HSV_DEEP;o++)
+      for(int c=LIPREC_CONTOUR_THRESHOLD;c<=LIPREC_CONTOUR_CANNY;c++)
+         for(int p=LIPREC_PLATECON_THRESHOLD;p<=LIPREC_PLATECON_CANNY;p++) {
+            LiPRec detector(o, c, p);
+            PlatesImage plates;
+            for(unsigned int f=0;f<frames.size();f++)
+               detector.detectPlates(frames[f].image, &plates);
+            detector.setTiming();
+
+            vector<double> latency;
+            double total = 0;
+            Accuracy acc;
+            for(int n=0;n<iterations;n++)
+               for(unsigned int f=0;f<frames.size();f++) {
+                  PlatesImage result;
+                  int64 t0 = getTickCount();
+                  detector.detectPlates(frames[f].image, &result);
+                  latency.push_back(ticksToUs(getTickCount()-t0)/1000.0);
+                  total += latency.back();
+                  if(n == 0 && frames[f].labelled)
+                     scorePlates(frames[f].truth, result.plates, acc);
+               }
+            std::sort(latency.begin(), latency.end());
+            const StageStats *stats = detector.stageStats();
+            ModeResult r;
+            r.rate = total > 0 ? latency.size()*1000.0/total : 0;
+            r.p50 = percentile(latency, 0.50);
+            r.p95 = percentile(latency, 0.95);
+            r.p99 = percentile(latency, 0.99);
+            r.ocr = total > 0 ? (stats->total[LIPREC_STAGE_RECOGNIZE] +
+                                 stats->total[LIPREC_STAGE_TEXT])/1000.0/total : 0;
+            r.recall = r.precision = r.exact = r.chars = -1;
+            if(labelled) {
+               r.recall = acc.expected ? (double)acc.matched/acc.expected : 1;
+               r.precision = acc.detected ? (double)acc.matched/acc.detected : 1;
+               r.exact = acc.expected ? (double)acc.exact/acc.expected : 1;
+               r.chars = acc.expected ? acc.chars/acc.expected : 1;
+            }
+
+            string key = string(optimizationNames[o-1]) + "," + contourNames[c-1] + "," +
+                         contourNames[p-1];
+            string verdict = "-";
+            map<string, ModeResult>::const_iterator base = baseline.find(key);
+            if(base != baseline.end()) {
+               const ModeResult &b = base->second;
+               char change[64];
+               snprintf(change, sizeof(change), "%+.1f%%", b.rate > 0 ? 100.0*(r.rate/b.rate-1) : 0.0);
+               verdict = change;
+               // accuracy may not drop by more than tolerance points
+               bool worse = b.exact >= 0 && r.exact >= 0 &&
+                            (r.recall < b.recall - tolerance/100 || r.exact < b.exact - tolerance/100);
+               if(worse || r.rate < b.rate*(1-tolerance/100) || r.p95 > b.p95*(1+tolerance/100)) {
+                  verdict += " REGRESSION";
+                  regressions++;
+               }
+            }
+            printf("%-11s %-14s %-14s %10.2f %8.2f %8.2f %8.2f %5.1f%%", optimizationNames[o-1],
+                   contourNames[c-1], contourNames[p-1], r.rate, r.p50, r.p95, r.p99, 100*r.ocr);
+            if(labelled)
+               printf(" %5.1f%% %5.1f%% %5.1f%% %5.1f%%", 100*r.recall, 100*r.precision,
+                      100*r.exact, 100*r.chars);
+            printf(" %s\n", verdict.c_str());
+            if(csv) {
+               fprintf(csv, "%s,%.3f,%.3f,%.3f,%.3f,%.4f", key.c_str(), r.rate, r.p50, r.p95,
+                       r.p99, r.ocr);
+               if(labelled)
+                  fprintf(csv, ",%.4f,%.4f,%.4f,%.4f\n", r.recall, r.precision, r.exact, r.chars);
+               else
+                  fprintf(csv, ",,,,\n");
+            }
+         }
+   if(csv)
+      fclose(csv);
+   if(regressions)
+      printf("%d combinations slower or less accurate than the baseline by more than %.0f%%\n",
+             regressions, tolerance);
+   return regressions ? 1 : 0;
+}
+
+
+// Sets up detector for the variant value of a reader benchmark
+typedef void (*ReaderSetup)(LiPRec &detector, int value);
+
+static void setupRecognizer(LiPRec &detector, int engine)
+{
+   detector.setRecognizer(engine);
+}
+
+static void setupInput(LiPRec &detector, int input)
+{
+   detector.setOCRInput(input);
+}
+
+// The same detection with every value of a reader setting. Prepare is the
+// time to make the OCR input (crop and plate binarization), OCR the time
+// to read it, both per frame; accuracy is on the plates of the first
+// iteration.
+static int benchReaders(const vector<BenchFrame> &frames, int iterations, const char *column,
+                        ReaderSetup setup, const int *values, const char * const *names,
+                        int count)
+{
+   bool labelled = false;
+   for(unsigned int f=0;f<frames.size();f++)
+      labelled |= frames[f].labelled;
+
+   printf("%-10s %10s %12s %12s %8s", column, "images/s", "prepare(us)", "ocr(us)", "plates");
+   if(labelled)
+      printf(" %6s %6s %6s", "recall", "exact", "chars");
+   printf("\n");
+   for(int v=0;v<count;v++) {
+      LiPRec detector;
+      setup(detector, values[v]);
+      PlatesImage warm;
+      for(unsigned int f=0;f<frames.size();f++)
+         detector.detectPlates(frames[f].image, &warm);
+      detector.setTiming();
+
+      Accuracy acc;
+      size_t found = 0;
+      int64 t0 = getTickCount();
+      for(int n=0;n<iterations;n++)
+         for(unsigned int f=0;f<frames.size();f++) {
+            PlatesImage result;
+            detector.detectPlates(frames[f].image, &result);
+            if(n > 0)
+               continue;
+            found += result.plates.size();
+            if(frames[f].labelled)
+               scorePlates(frames[f].truth, result.plates, acc);
+         }
+      double us = ticksToUs(getTickCount()-t0);
+      const StageStats *stats = detector.stageStats();
+      double prepare = stats->mean(LIPREC_STAGE_CROP) + stats->mean(LIPREC_STAGE_PLATE);
+      double ocr = stats->mean(LIPREC_STAGE_RECOGNIZE) + stats->mean(LIPREC_STAGE_TEXT);
+      printf("%-10s %10.2f %12.1f %12.1f %8lu", names[v], frames.size()*iterations*1000000.0/us,
+             prepare, ocr, (unsigned long)found);
+      if(labelled && acc.expected)
+         printf(" %5.1f%% %5.1f%% %5.1f%%", 100.0*acc.matched/acc.expected,
+                100.0*acc.exact/acc.expected, 100.0*acc.chars/acc.expected);
+      printf("\n");
+   }
+   return 0;
+}
+
+static const int recognizers[] = { LIPREC_OCR_TESSERACT, LIPREC_OCR_GLYPHS };
+static const char *recognizerNames[] = { "tesseract", "glyphs" };
+// Every candidate cropped, scaled and binarized on its own, and one band
+// per frame read by rectangles: the more candidates (-c on synthetic
+// frames) the more the band saves
+static const int ocrInputs[] = { LIPREC_OCR_INPUT_CROPS, LIPREC_OCR_INPUT_FRAME };
+static const char *ocrInputNames[] = { "crops", "frame" };
+
+
+struct KernelTime {
+   KernelTime() : total(0), best(0), runs(0) { }
+   void add(double us)
+   {
+      best = runs ? std::min(best, us) : us;
+      total += us;
+      runs++;
+   }
+   double total, best;
+   int runs;
+};
+
+static void printKernel(const char *frame, const char *stage, const char *mode, const KernelTime &t,
+                        const char *note="")
+{
+   printf("%-16s %-10s %-14s %10.1f %10.1f %s\n", frame, stage, mode,
+          t.runs ? t.total/t.runs : 0.0, t.best, note);
+}
+
+// Image files are also measured scaled to these widths
+static const int stageWidths[] = { 1280, 1920, 3840 };
+
+// The kernels of a detection one by one, in the library: optimizeImage in
+// every mode, maximizeContrast, then findCandidates with the stage timers
+// for every edge mode (edges, findContours, the filter and what each of its
+// rules rejected) and every plate binarization (per candidate). No OCR runs.
+static int benchStages(const vector<BenchFrame> &input, int iterations)
+{
+   vector<BenchFrame> frames;
+   for(unsigned int f=0;f<input.size();f++) {
+      frames.push_back(input[f]);
+      if(input[f].name.find("synthetic-") == 0)
+         continue;
+      for(int s=0;s<3;s++) {
+         BenchFrame scaled;
+         char name[64];
+         snprintf(name, sizeof(name), "%s@%d", baseName(input[f].name).c_str(), stageWidths[s]);
+         scaled.name = name;
+         int height = input[f].image.rows*stageWidths[s]/input[f].image.cols;
+         resize(input[f].image, scaled.image, Size(stageWidths[s], std::max(1, height)), 0, 0,
+                INTER_LINEAR);
+         frames.push_back(scaled);
+      }
+   }
+
+   printf("%-16s %-10s %-14s %10s %10s\n", "frame", "stage", "mode", "mean(us)", "best(us)");
+   for(unsigned int f=0;f<frames.size();f++) {
+      const Mat &img = frames[f].image;
+      const char *name = frames[f].name.c_str();
+      Mat optimized, grey;
+
+      for(int o=LIPREC_OPTIMIZATION_GREY_BASIC;o<=LIPREC_OPTIMIZATION_HSV_DEEP;o++) {
+         LiPRec detector(o);
+         DetectContext ctx(detector);
+         KernelTime t;
+         detector.optimizeImage(img, optimized, ctx);
+         for(int n=0;n<iterations;n++) {
+            int64 t0 = getTickCount();
+            detector.optimizeImage(img, optimized, ctx);
+            t.add(ticksToUs(getTickCount()-t0));
+         }
+         printKernel(name, "optimize", optimizationNames[o-1], t);
+      }
+
+      LiPRec detector;
+      DetectContext ctx(detector);
+      detector.optimizeImage(img, optimized, ctx);
+      cvtColor(img, grey, CV_RGB2GRAY);
+      {
+         KernelTime t;
+         Mat work = grey.clone();
+         detector.maximizeContrast(work, ctx);
+         for(int n=0;n<iterations;n++) {
+            grey.copyTo(work);
+            int64 t0 = getTickCount();
+            detector.maximizeContrast(work, ctx);
+            t.add(ticksToUs(getTickCount()-t0));
+         }
+         printKernel(name, "contrast", "top/black hat", t);
+      }
+
+      // the edge modes on the GREY_BASIC image, and then every plate
+      // binarization on the candidates the default edge mode finds
+      for(int pass=0;pass<2;pass++) {
+         int last = pass == 0 ? LIPREC_CONTOUR_CANNY : LIPREC_PLATECON_CANNY;
+         for(int m=1;m<=last;m++) {
+            LiPRec stage(LIPREC_OPTIMIZATION_GREY_BASIC, pass == 0 ? m : LIPREC_CONTOUR_CANNY,
+                         pass == 0 ? LIPREC_PLATECON_THRESHOLD : m);
+            DetectContext sctx(stage);
+            sctx.setTiming();
+            FrameCandidates candidates;
+            stage.findCandidates(img, optimized, &candidates, sctx);
+            KernelTime edge, contours, filter, plate;
+            size_t count = candidates.count;
+            for(int n=0;n<iterations;n++) {
+               stage.findCandidates(img, optimized, &candidates, sctx);
+               edge.add(candidates.timing[LIPREC_STAGE_EDGE]);
+               contours.add(candidates.timing[LIPREC_STAGE_CONTOURS]);
+               filter.add(candidates.timing[LIPREC_STAGE_FILTER]);
+               plate.add(count ? candidates.timing[LIPREC_STAGE_PLATE]/count : 0);
+            }
+            char note[64];
+            snprintf(note, sizeof(note), "%lu candidates", (unsigned long)count);
+            if(pass == 0) {
+               printKernel(name, "edge", contourNames[m-1], edge);
+               printKernel(name, "contours", contourNames[m-1], contours);
+               printKernel(name, "filter", contourNames[m-1], filter, note);
+               // what every rule of the filter removed, per frame
+               unsigned long runs = iterations+1;
+               printf("%-16s %-10s %-14s %10lu contours:", "", "", "", sctx.contoursSeen()/runs);
+               for(int r=0;r<LIPREC_REJECT_RULES;r++)
+                  printf(" %s -%lu", DetectContext::rejectName(r), sctx.contoursRejected(r)/runs);
+               printf("\n");
+            } else
+               printKernel(name, "plate", contourNames[m-1], plate, "per candidate");
+         }
+      }
+   }
+   return 0;
+}
+
+
+// Share of the reference candidates found again, as a box overlapping
+// at least half of their union
+static double candidatesRecall(const FrameCandidates &reference, const FrameCandidates &found)
+{
+   if(reference.count == 0)
+      return 1.0;
+   size_t matched = 0;
+   for(size_t i=0;i<reference.count;i++) {
+      const Rect &r = reference.candidates[i].rect;
+      for(size_t j=0;j<found.count;j++) {
+         const Rect &f = found.candidates[j].rect;
+         double inter = (r & f).area();
+         if(inter >= 0.5*(r.area() + f.area() - inter)) {
+            matched++;
+            break;
+         }
+      }
+   }
+   return (double)matched/reference.count;
+}
+
+
+static int benchSearch(const vector<BenchFrame> &frames, int iterations)
+{
+   const int levels[] = { LIPREC_SEARCH_FULL, 1, 2, 3, LIPREC_SEARCH_AUTO };
+
+   LiPRec detector;
+   DetectContext ctx(detector);
+   printf("%-24s %11s %6s %10s %8s %10s %s\n", "frame", "size", "level", "search(ms)",
+          "speedup", "candidates", "recall");
+   for(unsigned int f=0;f<frames.size();f++) {
+      Mat optimized;
+      detector.optimizeImage(frames[f].image, optimized);
+      char size[32];
+      snprintf(size, sizeof(size), "%dx%d", frames[f].image.cols, frames[f].image.rows);
+
+      FrameCandidates reference;
+      double full = 0;
+      for(unsigned int l=0;l<sizeof(levels)/sizeof(levels[0]);l++) {
+         detector.setSearchLevel(levels[l]);
+         FrameCandidates found;
+         detector.findCandidates(frames[f].image, optimized, &found, ctx);
+         int64 t0 = getTickCount();
+         for(int n=0;n<iterations;n++)
+            detector.findCandidates(frames[f].image, optimized, &found, ctx);
+         double ms = ticksToUs(getTickCount()-t0)/1000.0/iterations;
+         if(levels[l] == LIPREC_SEARCH_FULL) {
+            reference = found;
+            full = ms;
+         }
+         char level[16] = "auto";
+         if(levels[l] != LIPREC_SEARCH_AUTO)
+            snprintf(level, sizeof(level), "%d", levels[l]);
+         printf("%-24s %11s %6s %10.2f %7.2fx %10d %5.1f%%\n", frames[f].name.c_str(), size, level,
+                ms, ms > 0 ? full/ms : 0.0, (int)found.count,
+                100.0*candidatesRecall(reference, found));
+      }
+   }
+   return 0;
+}
+
+
+// Every frame is repeated iterations times in the batch
+static int benchBatch(const vector<BenchFrame> &frames, int iterations, int workers)
+{
+   vector<Mat> images;
+   for(int n=0;n<iterations;n++)
+      for(unsigned int f=0;f<frames.size();f++)
+         images.push_back(frames[f].image);
+
+   LiPRec detector;
+   vector<PlatesImage> reference(images.size());
+   int64 t0 = getTickCount();
+   for(unsigned int i=0;i<images.size();i++) {
+      Mat img = images[i];
+      detector.detectPlates(img, &reference[i]);
+   }
+   double sequential = ticksToUs(getTickCount()-t0)/1000000.0;
+
+   printf("%-10s %8s %10s %8s %10s %s\n", "threads", "images", "images/s", "speedup",
+          "efficiency", "results");
+   printf("%-10s %8d %10.2f %7.2fx %10s %s\n", "sequential", (int)images.size(),
+          images.size()/sequential, 1.0, "-", "reference");
+   double base=0;
+   for(int t=1;t<=workers;t++) {
+      vector<PlatesImage> results;
+      // the first call with t threads starts their OCR engines
+      vector<Mat> warmup(images.begin(), images.begin()+std::min<size_t>(t, images.size()));
+      detector.detectPlatesBatch(warmup, results, 600, 6000, t);
+
+      t0 = getTickCount();
+      detector.detectPlatesBatch(images, results, 600, 6000, t);
+      double secs = ticksToUs(getTickCount()-t0)/1000000.0;
+      if(t == 1)
+         base = secs;
+
+      bool same = results.size() == reference.size();
+      for(unsigned int i=0;same && i<results.size();i++)
+         same = samePlates(reference[i], results[i]);
+      printf("%-10d %8d %10.2f %7.2fx %9.0f%% %s\n", t, (int)images.size(), images.size()/secs,
+             base/secs, 100.0*base/secs/t, same ? "same" : "DIFFERENT");
+   }
+   return 0;
+}
+
+
+int main(int argc, char* argv[])
+{
+   int iterations=20;
+   int plates=12;
+   int workers=getNumberOfCPUs();
+
+   argc-=(argc>0); argv+=(argc>0); // skip program name argv[0] if present
+   option::Stats  stats(usage, argc, argv);
+   option::Option options[stats.options_max], buffer[stats.buffer_max];
+   option::Parser parse(usage, argc, argv, options, buffer);
+   if(parse.error())
+   {
+      cout << "Error parsing options\n";
+      return -1;
+   }
+
+   if (options[OPT_HELP] || parse.nonOptionsCount()<1) {
+      option::printUsage(std::cout, usage);
+      return options[OPT_HELP] ? 0 : -1;
+   }
+   if (options[OPT_ITERATIONS] && options[OPT_ITERATIONS].arg)
+      iterations = std::max(1, atoi(options[OPT_ITERATIONS].arg));
+   if (options[OPT_CANDIDATES] && options[OPT_CANDIDATES].arg)
+      plates = std::max(0, atoi(options[OPT_CANDIDATES].arg));
+   if (options[OPT_WORKERS] && options[OPT_WORKERS].arg)
+      workers = std::max(1, atoi(options[OPT_WORKERS].arg));
+
+   GroundTruth truth;
+   if(options[OPT_TRUTH] && options[OPT_TRUTH].arg && !loadGroundTruth(options[OPT_TRUTH].arg, truth)) {
+      cout << "Cannot open ground truth " << options[OPT_TRUTH].arg << endl;
+      return -1;
+   }
+
+   vector<BenchFrame> frames;
+   loadFrames(parse, plates, options[OPT_TRUTH] ? &truth : NULL, frames);
+
+   cv::String bench = parse.nonOption(0);
+   if(bench == "crop")
+      return benchCrop(frames, iterations);
+   if(bench == "ocr")
+      return benchOCR(frames, iterations, workers);
+   if(bench == "batch")
+      return benchBatch(frames, iterations, workers);
+   if(bench == "deep")
+      return benchDeep(frames, iterations);
+   if(bench == "value")
+      return benchValue(frames, iterations);
+   if(bench == "search")
+      return benchSearch(frames, iterations);
+   if(bench == "glyphs")
+      return benchReaders(frames, iterations, "recognizer", setupRecognizer, recognizers,
+                          recognizerNames, 2);
+   if(bench == "stages")
+      return benchStages(frames, iterations);
+   if(bench == "input")
+      return benchReaders(frames, iterations, "input", setupInput, ocrInputs, ocrInputNames, 2);
+   if(bench == "modes")
+      return benchModes(frames, iterations, options[OPT_OUTPUT].arg, options[OPT_BASELINE].arg,
+                        options[OPT_TOLERANCE].arg ? atof(options[OPT_TOLERANCE].arg) : 10.0);
+
+   cout << "Unknown benchmark " << bench << "\n\n";
+   option::printUsage(std::cout, usage);
+   return -1;
+}